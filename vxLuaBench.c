@@ -0,0 +1,384 @@
+/**
+ * Benchmarks of the hot paths of the vxLuaGlue layer, run them from the
+ * target shell:
+ *   -> TSysLuaBench()                    all benchmarks, default counts
+ *   -> TSysLuaBench(100000, "/c0/x.lua") count loop iterations and the load
+ *                                        time of a script file
+ *   -> TSysLuaArgBench(100000)           cost of one vxDo argument by type
+ * The loops run in lua, each result is the time of the loop minus the time
+ * of an empty loop, divided by the number of iterations. Times are 
+ * sysTimestamp() deltas, so they have sysTimestamp resolution. Runs longer
+ * than a timestamp period add the whole periods counted by tickGet().
+ *
+ * Only the public API of vxLuaGlue.h is used. Build this file together with
+ * vxLuaGlue.c, or leave it out of production images.
+ *
+ * Version : 1.0    14 Oct 2026
+ *           Initial version.
+ */
+#include <vxWorks.h>
+#include <symLib.h>
+#include <sysSymTbl.h>
+#include <sysLib.h>
+#include <tickLib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "vxLuaGlue.h"
+
+/* Default number of loop iterations */
+#define BENCH_COUNT         100000
+
+/* Default number of states created and destroyed */
+#define BENCH_STATES        100
+
+/* Size of generated scripts */
+#define BENCH_SCRIPT_SIZE   1024
+
+/* Time stamp for benchmarks: clock ticks and the timestamp read with them */
+typedef struct {
+    ULONG   tick;
+    UINT32  stamp;
+} BENCH_TIME;
+
+/* Argument of symEach routines, pointer wide since 6.9 */
+#if defined(_WRS_VXWORKS_MAJOR) && \
+    (_WRS_VXWORKS_MAJOR > 6 || (_WRS_VXWORKS_MAJOR == 6 && _WRS_VXWORKS_MINOR >= 9))
+#define BENCH_SYM_ARG(p)    ((_Vx_usr_arg_t) (p))
+#else
+#define BENCH_SYM_ARG(p)    ((int) (p))
+#endif
+
+/* Variable accessed by the vxGet/vxSet benchmarks */
+int LuaBenchVariable = 0;
+
+/**
+ * Does nothing, called by the benchmarks. Called with more arguments than
+ * it takes, the extra words are ignored.
+ */
+int LuaBenchFunc(int a1, int a2, int a3, int a4, int a5, int a6, int a7, int a8)
+{
+    return a1 + a8;
+}
+
+/**
+ * Reads the current time.
+ */
+LOCAL void benchNow(BENCH_TIME * pTime)
+{
+    do
+    {
+        pTime->tick  = tickGet();
+        pTime->stamp = sysTimestamp();
+    } while (pTime->tick != tickGet());
+}
+
+/**
+ * Returns the microseconds since t0.
+ */
+LOCAL double benchUs(const BENCH_TIME * pT0)
+{
+    BENCH_TIME t1;
+    UINT32     period = sysTimestampPeriod();
+    UINT32     freq   = sysTimestampFreq();
+    double     ticks;
+    double     stamps;
+    double     wraps;
+
+    benchNow(&t1);
+    ticks = (double) (t1.tick - pT0->tick);
+
+    /* A timestamp reset at every clock tick counts within the tick */
+    if ((double) period * sysClkRateGet() == (double) freq)
+    {
+        stamps = ticks * period + (double) t1.stamp - (double) pT0->stamp;
+        return stamps * 1e6 / freq;
+    }
+
+    /* A free running one wraps at period, the ticks tell how often */
+    stamps = (t1.stamp >= pT0->stamp) ? (double) (t1.stamp - pT0->stamp)
+                                      : (double) t1.stamp + (period - pT0->stamp);
+    wraps  = (ticks * freq / sysClkRateGet() - stamps) / period + 0.5;
+    if (wraps >= 1)
+    {
+        stamps += (double) (ULONG) wraps * period;
+    }
+    return stamps * 1e6 / freq;
+}
+
+/**
+ * Runs a script from memory in ctx, returns its run time in microseconds
+ * or -1 on error.
+ */
+LOCAL double benchRun(TSYS_LUA_ID ctx, const char * script)
+{
+    BENCH_TIME t0;
+
+    benchNow(&t0);
+    if (OK != TSysRunLuaBufferEx(ctx, script, strlen(script), "=bench"))
+    {
+        printf("bench: %s\n", TSysLuaGetError(ctx));
+        return -1;
+    }
+    return benchUs(&t0);
+}
+
+/**
+ * Runs count iterations of the loop body in ctx and returns the time of
+ * one iteration in microseconds, without the time of the empty loop.
+ */
+LOCAL double benchLoop(TSYS_LUA_ID ctx, int count, const char * body)
+{
+    char   script[BENCH_SCRIPT_SIZE];
+    double empty;
+    double us;
+
+    sprintf(script, "for i = 1, %d do end", count);
+    empty = benchRun(ctx, script);
+
+    sprintf(script, "local vxDo, vxGet, vxSet = vxDo, vxGet, vxSet "
+                    "for i = 1, %d do %s end", count, body);
+    us = benchRun(ctx, script);
+    if (us < 0 || empty < 0)
+    {
+        return -1;
+    }
+    return (us - empty) / count;
+}
+
+/**
+ * Prints one result, us is the time of one operation.
+ */
+LOCAL void benchPrint(const char * name, double us)
+{
+    if (us < 0)
+    {
+        printf("%-32s failed\n", name);
+    }
+    else if (us > 0)
+    {
+        printf("%-32s %12.3f us %12.0f per s\n", name, us, 1e6 / us);
+    }
+    else
+    {
+        printf("%-32s %12.3f us\n", name, us);
+    }
+}
+
+/**
+ * symEach routine counting the symbols.
+ */
+LOCAL BOOL benchSymCount(char * name, char * val, SYM_TYPE type, int * pCount, UINT16 group)
+{
+    (*pCount)++;
+    return TRUE;
+}
+
+/**
+ * vxDo calls per second by number of arguments.
+ */
+LOCAL void benchCalls(TSYS_LUA_ID ctx, int count)
+{
+    static const int arities[] = { 0, 1, 2, 4, 8, 16, 32 };
+    char   body[BENCH_SCRIPT_SIZE];
+    char   name[32];
+    char * p;
+    int    i;
+    int    n;
+
+    for (i = 0; i < (int) (sizeof(arities) / sizeof(arities[0])); i++)
+    {
+        p = body + sprintf(body, "vxDo(\"LuaBenchFunc\"");
+        for (n = 0; n < arities[i]; n++)
+        {
+            p += sprintf(p, ", %d", n);
+        }
+        strcpy(p, ")");
+        sprintf(name, "vxDo, %d arguments", arities[i]);
+        benchPrint(name, benchLoop(ctx, count, body));
+    }
+
+    benchRun(ctx, "benchFunc = vxBind(\"LuaBenchFunc\")");
+    benchPrint("vxBind function, 4 arguments",
+               benchLoop(ctx, count, "benchFunc(1, 2, 3, 4)"));
+}
+
+/**
+ * vxGet/vxSet throughput.
+ */
+LOCAL void benchVariables(TSYS_LUA_ID ctx, int count)
+{
+    benchPrint("vxGet", benchLoop(ctx, count, "vxGet(\"LuaBenchVariable\")"));
+    benchPrint("vxSet", benchLoop(ctx, count, "vxSet(\"LuaBenchVariable\", i)"));
+    benchPrint("vxGet u16", benchLoop(ctx, count, "vxGet(\"LuaBenchVariable\", \"u16\")"));
+    benchRun(ctx, "benchVar = vxVar(\"LuaBenchVariable\")");
+    benchPrint("vxVar value", benchLoop(ctx, count, "benchVar.value = benchVar.value + 1"));
+}
+
+/**
+ * Symbol resolution latency against the size of the symbol table: the
+ * first lookup after a flush rebuilds the partial match index, a name
+ * that does not exist is searched in the symbol table and the index on
+ * every call.
+ */
+LOCAL void benchResolve(TSYS_LUA_ID ctx, int count)
+{
+    static const char * miss = "vxDo(\"LuaBenchNoSuchFunction\")";
+    int    nSyms = 0;
+    double us;
+
+    symEach(sysSymTbl, (FUNCPTR) benchSymCount, BENCH_SYM_ARG(&nSyms));
+    printf("symbol table: %d symbols\n", nSyms);
+
+    TSysLuaSymCacheFlush();
+    us = benchRun(ctx, miss);
+    benchPrint("lookup after flush (rebuild)", us);
+    benchPrint("lookup of missing name", benchLoop(ctx, count / 100 + 1, miss));
+
+    TSysLuaSymCacheFlush();
+    us = benchRun(ctx, "vxDo(\"LuaBenchFunc\")");
+    benchPrint("first lookup after flush", us);
+}
+
+/**
+ * State creation and teardown time.
+ */
+LOCAL void benchStates(int nStates)
+{
+    TSYS_LUA_PARAMS params;
+    TSYS_LUA_ID     ctx;
+    BENCH_TIME      t0;
+    int             i;
+
+    benchNow(&t0);
+    for (i = 0; i < nStates; i++)
+    {
+        TSysLuaDestroy(TSysLuaCreate());
+    }
+    benchPrint("create/destroy, all libs", benchUs(&t0) / nStates);
+
+    TSysLuaParamsInit(&params);
+    params.libs      = TSYS_LUA_LIB_BASE;
+    params.noGlobals = TRUE;
+    benchNow(&t0);
+    for (i = 0; i < nStates; i++)
+    {
+        TSysLuaDestroy(TSysLuaCreateEx(&params));
+    }
+    benchPrint("create/destroy, base only", benchUs(&t0) / nStates);
+
+    ctx = TSysLuaCreate();
+    if (ctx == NULL)
+    {
+        return;
+    }
+    benchNow(&t0);
+    for (i = 0; i < nStates; i++)
+    {
+        TSysLuaReset(ctx);
+    }
+    benchPrint("reset", benchUs(&t0) / nStates);
+    TSysLuaDestroy(ctx);
+}
+
+/**
+ * Script load time: a generated chunk from memory and, with path, a script
+ * file the first time (loaded) and the second time (cached).
+ */
+LOCAL void benchLoad(TSYS_LUA_ID ctx, const char * path)
+{
+    char       script[BENCH_SCRIPT_SIZE * 8];
+    char *     p = script;
+    BENCH_TIME t0;
+    int        i;
+
+    for (i = 0; i < 100; i++)
+    {
+        p += sprintf(p, "local function f%d(a, b) return a + b * %d end\n", i, i);
+    }
+    benchPrint("load and run 100 functions", benchRun(ctx, script));
+
+    if (path != NULL)
+    {
+        TSysLuaChunkCacheFlush(ctx);
+        benchNow(&t0);
+        TSysRunLuaScriptEx(ctx, (char *) path);
+        benchPrint("script file, first run", benchUs(&t0));
+        benchNow(&t0);
+        TSysRunLuaScriptEx(ctx, (char *) path);
+        benchPrint("script file, cached", benchUs(&t0));
+    }
+}
+
+/**
+ * Runs all benchmarks with count loop iterations (default 100000). With
+ * scriptPath, the load time of that script file is measured as well.
+ */
+void TSysLuaBench(int count, const char * scriptPath)
+{
+    TSYS_LUA_ID ctx;
+
+    if (count <= 0)
+    {
+        count = BENCH_COUNT;
+    }
+    ctx = TSysLuaCreate();
+    if (ctx == NULL)
+    {
+        printf("TSysLuaBench(): no lua state\n");
+        return;
+    }
+
+    printf("timestamp: %u Hz, %d iterations\n",
+           (unsigned int) sysTimestampFreq(), count);
+    benchCalls(ctx, count);
+    benchVariables(ctx, count);
+    benchResolve(ctx, count);
+    benchLoad(ctx, scriptPath);
+    TSysLuaDestroy(ctx);
+    benchStates(BENCH_STATES);
+}
+
+/**
+ * Measures the cost of one argument of vxDo for 8 numbers, 8 strings and
+ * 8 mixed arguments, count calls each (default 100000). Build vxLuaGlue.c
+ * with LUA_ARG_CHAIN defined for the cost of the conversion before 1.5.
+ */
+void TSysLuaArgBench(int count)
+{
+    static const char * bodies[] = {
+        "vxDo(\"LuaBenchFunc\")",
+        "vxDo(\"LuaBenchFunc\", 1, 2, 3, 4, 5, 6, 7, 8)",
+        "vxDo(\"LuaBenchFunc\", \"a\", \"b\", \"c\", \"d\", \"e\", \"f\", \"g\", \"h\")",
+        "vxDo(\"LuaBenchFunc\", 1, \"a\", true, nil, 2.5, benchBuf, 3, \"b\")"
+    };
+    static const char * names[] = { "none", "numbers", "strings", "mixed" };
+    TSYS_LUA_ID ctx;
+    double      base;
+    double      us;
+    int         i;
+
+    if (count <= 0)
+    {
+        count = BENCH_COUNT;
+    }
+    ctx = TSysLuaCreate();
+    if (ctx == NULL)
+    {
+        return;
+    }
+    benchRun(ctx, "benchBuf = vxBuffer(4)");
+
+    /* Calls without arguments are the base line */
+    base = benchLoop(ctx, count, bodies[0]);
+    printf("%-8s %8.0f ns per call\n", names[0], base * 1e3);
+    for (i = 1; i < 4; i++)
+    {
+        us = benchLoop(ctx, count, bodies[i]);
+        printf("%-8s %8.0f ns per argument\n", names[i], (us - base) * 1e3 / 8.0);
+    }
+    TSysLuaDestroy(ctx);
+}
@@ -16,13 +16,19 @@
  * For example - a target system has following C++ functions: 
  *   _Z10runTestAllv --> runTestAll()
  *   _Z7runTesti     --> runTest(int)
+ *   _Z7runTestv     --> runTest()
  *   vxDo ("runTestAll")
- *      will be OK since the "runTestAll" is part of "_Z10runTestAllv"
+ *      will be OK since "runTestAll" is the base name of "_Z10runTestAllv"
  *      and the "_Z10runTestAllv" is unique in the symbol table.
  *   vxDo ("runTest",0)
- *      will fail since there are many symbols in the system having "runTest" 
+ *      will fail since there are many symbols in the system having the
+ *      base name "runTest" 
  *   vxDo ("_Z7runTesti",0)
  *      wil be Ok since the manging symbol is unique in the system
+ * The base names are kept in a sorted index, which is built on the first
+ * partial match and rebuilt on the first partial match after a module has 
+ * been loaded or unloaded. Names that are no C++ base name fall back to a
+ * substring search over the whole symbol table (INCLUDE_SYM_SUBSTR_MATCH).
  *
  * The advantage of this approach is that no wrapper functions need to be 
  * created for all C functions and they do not need to be registered within 
@@ -33,6 +39,92 @@
  * the vxGet and vxSet lua functions. 
  * To set a variable in C do vxSet("varname", 123) in lua.
  * To get a variable value do value = vxGet("varname") in lua.
+ * Since version 1.5 both take an optional type name (i8, u8, i16, u16, i32,
+ * u32, i64, u64, float, double); the default is u32:
+ * vxSet("varname", 1.5, "double")  value = vxGet("varname", "u16")
+ * vxVar resolves a variable once and returns a binding to it:
+ * counter = vxVar("varname", "u16")
+ * counter.value = counter.value + 1
+ *
+ * Blocks of memory are copied from and to lua strings with vxRead and 
+ * vxWrite, arrays of a memory type from and to lua tables with vxReadArray
+ * and vxWriteArray. Addresses are numbers or pointers from vxDoRet("p", ...),
+ * or vxBuffers, which are not accessed beyond their size:
+ * data = vxRead(addr, 4096)             vxWrite(addr, data)
+ * words = vxReadArray(addr, 16, "u32")  vxWriteArray(addr, words, "u32")
+ *
+ * Device registers are accessed with exactly their width by vxReg32, 
+ * vxReg16 and vxReg8, see "Register access" below:
+ * status = vxReg32(0xf0000014)          vxReg32(0xf0000010, 1)
+ *
+ * vxBuffer(n) allocates memory owned by lua, which is passed to C functions
+ * as pointer to its storage, see "Buffers" below:
+ * buf = vxBuffer(1500)
+ * len = vxDo("recv", sock, buf, #buf, 0)
+ * payload = tostring(buf:slice(0, len))
+ *
+ * Tables are passed as C arrays, vxStruct packs a struct, see 
+ * "Table arguments" below:
+ * vxDo("dsp_sum", {1.5, 2.5, 3.5, type = "double"}, 3)
+ * vxDo("set_config", vxStruct("iid", {1, 2, 0.5}))
+ *
+ * Lua functions are passed as C function pointers, see "Lua callbacks":
+ * vxDo("qsort", buf, n, 4, 
+ *      function(a, b) return vxReadArray(a, 1)[1] - vxReadArray(b, 1)[1] end)
+ * cb = vxCallback(function(ev) print(ev) return 0 end, 1)  vxCallbackFree(cb)
+ *
+ * Since version 1.5 calls that fail return nil, an error code (the errno) 
+ * and a message instead of printing it, e.g.
+ * result, err, msg = vxDo("my_c_function")
+ * After vxOption("strict", true) they raise a lua error instead. The 
+ * messages are also kept in a log, TSysLuaLogDump() prints it.
+ *
+ * Numeric strings like "100" are passed as numbers, after 
+ * vxOption("strictargs", true) all strings are passed as char *.
+ *
+ * All commands are also in the table vx, e.g. vx.vxDo("my_c_function"). 
+ * TSysLuaCreateEx can skip the global commands and select the lua libraries
+ * to open, or to open on the first require, for faster state creation:
+ * TSYS_LUA_PARAMS params;
+ * TSysLuaParamsInit(&params);
+ * params.libs     = TSYS_LUA_LIB_BASE | TSYS_LUA_LIB_STRING;
+ * params.lazyLibs = TSYS_LUA_LIB_IO | TSYS_LUA_LIB_OS;  -- local io = require("io")
+ * ctx = TSysLuaCreateEx(&params);
+ *
+ * Since version 1.5 resolved function addresses are cached per lua state and
+ * in a cache shared by all states, so repeated vxDo calls of the same 
+ * function skip the symbol table lookup, also in new states. The
+ * cache is invalidated when a module is loaded. When unloading modules while
+ * lua is running, use TSysLuaUnld()/TSysLuaUnldByModuleId() instead of the
+ * plain unld routines, or call TSysLuaSymCacheFlush() afterwards, so that no
+ * stale function address is ever called.
+ *
+ * vxSymbols(prefix) iterates over the symbols starting with prefix, see 
+ * "Symbol enumeration" below:
+ * for name in vxSymbols("drvX_", "text") do vxDo(name) end
+ *
+ * vxStats() returns the number of calls, the time spent and the symbol cache
+ * hits and misses per function, TSysLuaDumpStats(ctx) prints them.
+ *
+ * For functions called in tight loops, vxBind resolves the symbol once and
+ * returns a lua function that calls the C function directly:
+ * my_c_function = vxBind("my_c_function")
+ * result = my_c_function(1, 2, 5)
+ *
+ * Functions taking or returning double, float or 64 bit integers are called
+ * with vxDoSig and a signature of the argument types and the return type:
+ * result = vxDoSig("atan2", "dd>d", 1.5, 2.5)
+ * See "Calls with a signature" below for the type characters.
+ * vxDoRet takes the return type only, the arguments are passed like vxDo:
+ * pointer = vxDoRet("p", "malloc", 100)
+ * On 64 bit targets vxDo, vxBind and vxBatch return results that do not fit
+ * in an int, e.g. the pointer from vxDo("malloc", 100), as lightuserdata 
+ * with all bits, results that fit stay numbers.
+ * vxBind takes an optional signature: atan2 = vxBind("atan2", "dd>d")
+ *
+ * Many small calls are done at once by vxBatch, with function names or 
+ * functions returned by vxBind. It returns the first result of each call:
+ * results = vxBatch({ {"fnA", 1, 2}, {atan2, 1.5, 2.5} })
  * 
  * How to use it, at least how I did it:
  *  Get Lua 5.0.2 (the only one I tested) from http://www.lua.org .
@@ -44,6 +136,7 @@
  *  #include <time.h>   
  *  time.h was needed to avoid some strange compiler warnings. Don't ask...
  *  Copy vxLuaGlue.c and vxLuaGlue.h to the same directory. 
+ *  Optionally copy vxLuaBench.c as well, for the TSysLuaBench() benchmarks.
  *  Add the new sources to your vxworks 'make' file and compile your project. 
  *  
  *  Get Lua 5.2.1 (the one I tested) from http://www.lua.org .
@@ -63,6 +156,7 @@
  *  this is required to avoid compile error.
  * 
  *  Copy vxLuaGlue.c and vxLuaGlue.h to the same directory. 
+ *  Optionally copy vxLuaBench.c as well, for the TSysLuaBench() benchmarks.
  *  Add the new sources to your vxworks 'make' file and compile your project. 
  *
  *  Somewhere in your application call 'TSysStartLua()'. A good place is during
@@ -73,11 +167,53 @@
  *  vxWorks target shell to execute a script. 
  *  Call TSysStopLua() to unload lua when you do not need it anymore and
  *  want to free it's allocated memory.
+ *
+ *  To run scripts in parallel, each task needs its own lua state. Create one
+ *  with 'ctx = TSysLuaCreate()', run scripts with 
+ *  'TSysRunLuaScriptEx(ctx, "/c0/script.lua")' and free it with 
+ *  'TSysLuaDestroy(ctx)'. Alternatively create a pool of states once with
+ *  'TSysLuaPoolInit(4)' and let the tasks check a state out with 
+ *  'ctx = TSysLuaPoolGet(WAIT_FOREVER)' and back in with 'TSysLuaPoolPut(ctx)'.
+ *  'TSysLuaReset(ctx)' gives a state clean globals for the next run, but 
+ *  keeps its caches, faster than destroying and creating it again. 
+ *  'TSysLuaSnapshot(ctx)' makes the current globals the clean ones.
+ *
+ *  Against garbage collection pauses in periodic tasks, stop the automatic
+ *  collection with 'TSysLuaSetGcMode(ctx, TSYS_LUA_GC_MANUAL, 0, 0)' and run
+ *  it in bounded slices from an idle task with 'TSysLuaGcStep(ctx, 500)'.
+ *
+ *  'TSysLuaSetLimits(ctx, 10000000, 5 * sysClkRateGet())' aborts every run
+ *  in the context that takes more than 10 million lua instructions or more
+ *  than 5 seconds with an error.
+ *
+ *  'TSysRunLuaScriptAsync("/c0/script.lua", -1, doneFunc, arg)' queues a
+ *  script for a worker task and returns right away. The worker calls 
+ *  doneFunc(arg, status, errMsg) when the script is done. Start more 
+ *  workers with 'TSysLuaAsyncInit(nWorkers, maxJobs)'.
+ *  TSysLuaGetError(ctx) returns the error message of the last failed run.
+ *
+ *  Scripts that mostly wait can run as coroutines of one lua state on one 
+ *  task, see "Coroutine scheduler": 
+ *  'TSysLuaSchedSpawn(ctx, "/c0/mon1.lua")' for each script, then 
+ *  'TSysLuaSchedRun(ctx)'. The scripts wait with vxSleep, vxWaitSem and 
+ *  vxWaitMsg.
+ *
+ *  Scripts linked into the image or mapped from flash, as lua source or as
+ *  precompiled luac output, are run with 'TSysRunLuaBuffer(buf, len, name)'
+ *  without any file system access.
+ *
+ *  To keep the memory of a lua state out of the system memory partition, 
+ *  create it with a private partition:
+ *      TSYS_LUA_PARAMS params;
+ *      TSysLuaParamsInit(&params);
+ *      params.arenaSize = 512 * 1024;
+ *      ctx = TSysLuaCreateEx(&params);
  * 
  * Limits:
- *  - Only strings, boolean and integer numbers are supported. (More in next version?)
- *  - The number of parameters is limited to 15. (Can be extended, see code)
- *  - function name length maximum of 127 chars. (Can be extended, see code)
+ *  - Only strings, boolean and integer numbers are supported by vxDo. 
+ *    vxDoSig adds double, float and 64 bit integers.
+ *  - The number of parameters is limited to 32 (ARG_MAX_WORDS), 15 for 
+ *    vxDoSig. Left out parameters read as 0 up to ARG_MIN_WORDS.
  *  - Only tested on Lua 5.0.2, VxWorks 5.3 for X86 platforms 
  *    (HP-UX compile environment).
  *  - Tested on Lua 5.1.3, VxWorks 5.5.1 for MIPS
@@ -99,6 +235,38 @@
  *          This means you can do whatever you want to do with it. 
  *          In return I am not responsible in any way for this source code. 
  *
+ * Version : 1.5	14 Oct 2026
+ * 			 Added per lua state cache of resolved function symbols
+ * 			 Added vxBind to call functions without name lookup
+ * 			 Symbol partial match uses a sorted index of C++ base names
+ * 			 Symbol partial match is reentrant
+ * 			 Added multiple lua states and a pool of lua states
+ * 			 Compiled scripts are cached until the script file changes
+ * 			 Added TSysRunLuaBuffer to run scripts from memory
+ * 			 Lua states can allocate from a private memory partition
+ * 			 Added vxDoSig for double, float and 64 bit arguments
+ * 			 Added vxDoRet for pointer, string and other return types
+ * 			 Added typed vxGet/vxSet and vxVar variable bindings
+ * 			 Added vxRead/vxWrite and vxReadArray/vxWriteArray
+ * 			 Added vxBuffer
+ * 			 Added table arguments and vxStruct
+ * 			 Calls use one trampoline per argument count, up to 32
+ * 			 Added lua callbacks callable from C
+ * 			 Added TSysRunLuaScriptAsync and worker tasks
+ * 			 Added a coroutine scheduler with vxSleep/vxWaitSem/vxWaitMsg
+ * 			 Failed calls return nil, errcode, msg, added strict mode and log
+ * 			 Added call profiling with vxStats and TSysLuaDumpStats
+ * 			 Faster argument conversion, added strictargs option
+ * 			 Added vxBatch
+ * 			 Added vxReg32/16/8 and vxRegBlock register access
+ * 			 Added library selection, lazy libraries and the vx table
+ * 			 Added TSysLuaReset and TSysLuaSnapshot
+ * 			 Added TSysLuaSetGcMode and TSysLuaGcStep
+ * 			 Added TSysLuaSetLimits watchdog
+ * 			 Added vxSymbols
+ * 			 Added the benchmarks in vxLuaBench.c
+ * 			 Resolved symbols are shared by all lua states
+ *
  * Version : 1.4	26 Oct 2012		binl
  * 			 Modified a few lines for Lua 5.2.1
  * 			 Added symbol partial match to call C++ functions
@@ -153,15 +321,35 @@
 #include <symLib.h>
 #include <sysSymTbl.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/stat.h>
+#include <moduleLib.h>
+#include <unldLib.h>
+#include <semLib.h>
+#include <taskLib.h>
+#include <memPartLib.h>
+#include <intLib.h>
+#include <msgQLib.h>
+#include <tickLib.h>
+#include <errnoLib.h>
+#include <sysLib.h>
+#if defined(_WRS_VXWORKS_MAJOR) && \
+    (_WRS_VXWORKS_MAJOR > 6 || (_WRS_VXWORKS_MAJOR == 6 && _WRS_VXWORKS_MINOR >= 6))
+#include <vxAtomicLib.h>
+#define LUA_VX_ATOMIC
+#endif
 #include "a_out.h"
 
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "vxLuaGlue.h"
+
 /* On our system, all functions get a leading underscore. 
    Some other systems (ELF) do not get this leading underscore.
    Uncomment the #define below if you do not need the leading underscore.
@@ -179,41 +367,462 @@
 #else
 #endif
 
+/* Argument of taskSpawn entries and symEach callbacks, pointer wide since 
+   6.9 and on 64 bit targets */
+#if defined(_WRS_VXWORKS_MAJOR) && \
+    (_WRS_VXWORKS_MAJOR > 6 || (_WRS_VXWORKS_MAJOR == 6 && _WRS_VXWORKS_MINOR >= 9))
+typedef _Vx_usr_arg_t vx_usr_arg_t;
+#else
+typedef int vx_usr_arg_t;
+#endif
+
+/* Length of the table at stack index i */
+#if defined(LUA_5_2)
+#define luaTableLen(L,i)    ((int) lua_rawlen(L,i))
+#elif defined(LUA_5_1)
+#define luaTableLen(L,i)    ((int) lua_objlen(L,i))
+#else
+#define luaTableLen(L,i)    luaL_getn(L,i)
+#endif
+
+/* Memory in use by a lua state in KB */
+#if defined(LUA_5_2) || defined(LUA_5_1)
+#define luaMemKb(L)         (lua_gc(L,LUA_GCCOUNT,0) + lua_gc(L,LUA_GCCOUNTB,0) / 1024.0)
+#else
+#define luaMemKb(L)         ((double) lua_getgccount(L))
+#endif
+
+/* Sets the functions of a command table in the table on top of the stack */
+#if defined(LUA_5_2)
+#define luaSetFuncs(L,l)    luaL_setfuncs(L,l,0)
+#define luaPushGlobals(L)   lua_pushglobaltable(L)
+#elif defined(LUA_5_1)
+#define luaSetFuncs(L,l)    luaL_register(L,NULL,l)
+#define luaPushGlobals(L)   lua_pushvalue(L,LUA_GLOBALSINDEX)
+#else
+typedef luaL_reg luaL_Reg;
+#define luaSetFuncs(L,l)    luaL_openlib(L,NULL,l,0)
+#define luaPushGlobals(L)   lua_pushvalue(L,LUA_GLOBALSINDEX)
+#endif
+
 #undef INCLUDE_SYM_PART_MATCH
 #define INCLUDE_SYM_PART_MATCH
 
+/* Fall back to a substring search over the whole symbol table when the 
+   C++ name index has no match. Remove to make such lookups fail fast.
+*/
+#undef INCLUDE_SYM_SUBSTR_MATCH
+#define INCLUDE_SYM_SUBSTR_MATCH
+
+/* Bumped whenever the symbol table changes, everything derived from the 
+   symbol table with an older generation is stale */
+LOCAL volatile int symCacheGen = 1;
+
+/* Also print the lua log on the console */
+#undef LUA_LOG_CONSOLE
+
+/* Count calls, time and symbol cache hits per function, see vxStats().
+   Remove to save the two sysTimestamp() reads per call.
+*/
+#undef INCLUDE_LUA_STATS
+#define INCLUDE_LUA_STATS
+
+/* Convert call arguments with the chain of lua_isxxx checks of versions 
+   before 1.5 instead of one lua_type switch, for comparisons with 
+   TSysLuaArgBench(). The chain ignores the strictargs option.
+*/
+#undef LUA_ARG_CHAIN
+
+/* Memory barrier and atomic counters for data shared by the lua states of
+   all tasks. vxAtomicLib (VxWorks 6.6 and newer) provides both, before it
+   there is only one CPU and locking its interrupts is enough. */
+#if defined(_WRS_CONFIG_SMP) && !defined(VX_MEM_BARRIER_RW)
+#error "VX_MEM_BARRIER_RW of vxAtomicLib.h is required for SMP"
+#endif
+
+#ifdef VX_MEM_BARRIER_RW
+#define LUA_MEM_BARRIER()   VX_MEM_BARRIER_RW()
+#else
+#define LUA_MEM_BARRIER()
+#endif
+
+#ifdef LUA_VX_ATOMIC
+typedef atomic_t lua_atomic_t;
+#else
+typedef volatile int lua_atomic_t;
+#endif
+
+/**
+ * Adds n to the counter at p and returns its old value, atomically.
+ */
+LOCAL int luaAtomicAdd(lua_atomic_t * p, int n)
+{
+#ifdef LUA_VX_ATOMIC
+    return (int) vxAtomicAdd(p, n);
+#else
+    int key = intLock();
+    int old = *p;
+
+    *p = old + n;
+    intUnlock(key);
+    return old;
+#endif
+}
+
+/****************************************************************************** 
+ * Diagnostics log. 
+   Diagnostics of calls from lua go into a ring buffer instead of blocking 
+   the task on the console. Dump it with TSysLuaLogDump() from the shell.
+ *****************************************************************************/
+
+#define LUA_LOG_LINES   64      /* lines kept, a power of 2 */
+#define LUA_LOG_LEN     120     /* characters per line */
+
+typedef struct {
+    ULONG   tick;               /* tickGet() when logged */
+    char    text[LUA_LOG_LEN];
+} LUA_LOG_LINE;
+
+LOCAL LUA_LOG_LINE luaLogRing[LUA_LOG_LINES];
+LOCAL lua_atomic_t luaLogNext = 0;     /* number of lines logged */
+
+/**
+ * Logs a diagnostic line, never blocks. The line is claimed atomically, 
+ * tasks on other CPUs do not write into the same one.
+ */
+LOCAL void luaLog(const char * fmt, ...)
+{
+    LUA_LOG_LINE * pLine;
+    va_list        args;
+
+    pLine = &luaLogRing[(UINT32) luaAtomicAdd(&luaLogNext, 1) & (LUA_LOG_LINES - 1)];
+
+    pLine->tick = tickGet();
+    va_start(args, fmt);
+    vsnprintf(pLine->text, LUA_LOG_LEN, fmt, args);
+    va_end(args);
+#ifdef LUA_LOG_CONSOLE
+    printf("%s\n", pLine->text);
+#endif
+}
+
+/**
+ * Prints the lines in the log, oldest first.
+ */
+void TSysLuaLogDump()
+{
+    UINT32 n    = (UINT32) luaAtomicAdd(&luaLogNext, 0);
+    UINT32 i    = (n > LUA_LOG_LINES) ? n - LUA_LOG_LINES : 0;
+
+    for (; i < n; i++)
+    {
+        LUA_LOG_LINE * pLine = &luaLogRing[i & (LUA_LOG_LINES - 1)];
+
+        printf("%6u %10lu %s\n", (unsigned int) i, (unsigned long) pLine->tick, pLine->text);
+    }
+}
+
+/* Converts a symbol into an index entry, returns FALSE to leave it out */
+typedef BOOL (*SYM_INDEX_FILL)(void * pEntry, char * name, char * val, SYM_TYPE type);
+
+/* Index being built by symEach */
+typedef struct {
+    char *          entries;    /* entrySize bytes each */
+    int             count;
+    int             max;
+    size_t          entrySize;
+    SYM_INDEX_FILL  fill;
+    BOOL            failed;     /* out of memory */
+} SYM_INDEX_BUILD;
+
+/**
+ * symEach routine adding a symbol to the index being built.
+ */
+LOCAL BOOL symIndexEach
+    (
+    char *            name,     /* symbol name */
+    char *            val,      /* symbol value */
+    INT8              type,     /* symbol type */
+    SYM_INDEX_BUILD * pBuild,   /* index being built */
+    UINT16            group     /* symbol's module group */
+    )
+{
+    char * pEntries;
+
+    if (name == NULL)
+    {
+        return TRUE;
+    }
+
+    if (pBuild->count == pBuild->max)
+    {
+        int max = (pBuild->max == 0) ? 1024 : pBuild->max * 2;
+
+        pEntries = (char *) realloc(pBuild->entries, max * pBuild->entrySize);
+        if (pEntries == NULL)
+        {
+            pBuild->failed = TRUE;
+            return FALSE;
+        }
+        pBuild->entries = pEntries;
+        pBuild->max     = max;
+    }
+
+    if ((*pBuild->fill)(pBuild->entries + pBuild->count * pBuild->entrySize, name, val, type))
+    {
+        pBuild->count++;
+    }
+    return TRUE;
+}
+
+/**
+ * Builds an index of the symbols of symTblId: fill converts the symbols 
+ * into entries of entrySize bytes, which are sorted by cmp. Returns the 
+ * malloc'ed entries in *pEntries and their number in *pCount. Returns 
+ * ERROR when out of memory, an index missing symbols is never returned.
+ */
+LOCAL STATUS symIndexBuild(SYMTAB_ID symTblId, size_t entrySize, SYM_INDEX_FILL fill,
+                           int (*cmp)(const void *, const void *), 
+                           void ** pEntries, int * pCount)
+{
+    SYM_INDEX_BUILD build;
+
+    build.entries   = NULL;
+    build.count     = 0;
+    build.max       = 0;
+    build.entrySize = entrySize;
+    build.fill      = fill;
+    build.failed    = FALSE;
+    symEach(symTblId, (FUNCPTR) symIndexEach, (vx_usr_arg_t) &build);
+    if (build.failed)
+    {
+        free(build.entries);
+        return ERROR;
+    }
+
+    qsort(build.entries, build.count, entrySize, cmp);
+    *pEntries = build.entries;
+    *pCount   = build.count;
+    return OK;
+}
+
 #ifdef INCLUDE_SYM_PART_MATCH
-LOCAL int      matchCnt = 0;
-LOCAL SYMBOL * matchSym  = NULL;
+/* Entry of the C++ name index, sorted by the unmangled base name */
+typedef struct {
+   const char * base;      /* base name, points into the symbol name */
+   int          baseLen;   /* length of the base name */
+   char *       value;     /* symbol value */
+   SYM_TYPE     type;      /* symbol type */
+} SYM_INDEX_ENTRY;
+
+LOCAL SYM_INDEX_ENTRY * symIndex    = NULL;
+LOCAL int               symIndexCnt = 0;
+LOCAL int               symIndexGen = 0;   /* symCacheGen of the index */
+LOCAL SEM_ID            symIndexSem = NULL;/* guards the index */
+
+/**
+ * Creates the semaphore guarding the C++ name index.
+ */
+LOCAL void symIndexInit()
+{
+   if (symIndexSem == NULL)
+   {
+      symIndexSem = semMCreate (SEM_Q_PRIORITY | SEM_INVERSION_SAFE | SEM_DELETE_SAFE);
+   }
+}
+
+/**
+ * Extracts the base name from a mangled C++ name.
+ * _Z7runTesti gives runTest, _ZN3Foo3barEv gives bar (the last component).
+ */
+LOCAL BOOL symCppBaseName(const char * name, const char ** pBase, int * pLen)
+{
+   const char * p = name;
+   const char * base = NULL;
+   int          len = 0;
+   BOOL         nested = FALSE;
+
+   if (p[0] == '_' && p[1] == '_')    /* leading underscore */
+      p++;
+   if (p[0] != '_' || p[1] != 'Z')
+      return FALSE;
+   p += 2;
+
+   if (*p == 'N')
+   {
+      nested = TRUE;
+      for (p++; *p == 'r' || *p == 'V' || *p == 'K'; p++)
+         ;  /* skip cv qualifiers of methods */
+   }
+   else if (*p == 'L')                /* internal linkage */
+   {
+      p++;
+   }
+
+   while (isdigit ((int) *p))
+   {
+      int n = 0;
+
+      while (isdigit ((int) *p))
+         n = n * 10 + (*p++ - '0');
+      if (n <= 0 || memchr (p, '\0', n) != NULL)
+         return FALSE;
+      base = p;
+      len  = n;
+      p   += n;
+      if (!nested)
+         break;
+   }
+
+   if (base == NULL)
+      return FALSE;
+
+   *pBase = base;
+   *pLen  = len;
+   return TRUE;
+}
+
+/**
+ * Fills an entry of the C++ name index, only C++ symbols are added.
+ */
+LOCAL BOOL symIndexFill(void * p, char * name, char * val, SYM_TYPE type)
+{
+   SYM_INDEX_ENTRY * pEntry = (SYM_INDEX_ENTRY *) p;
+   const char *      base;
+   int               len;
+
+   if ( !symCppBaseName (name, &base, &len) )
+   {
+      return (FALSE);
+   }
+
+   pEntry->base    = base;
+   pEntry->baseLen = len;
+   pEntry->value   = val;
+   pEntry->type    = type;
+   return (TRUE);
+}
+
+/**
+ * Compares a base name with a name of the given length.
+ */
+LOCAL int symIndexNameCmp(const char * base, int baseLen, const char * name, int nameLen)
+{
+   int cmp = strncmp (base, name, (baseLen < nameLen) ? baseLen : nameLen);
+
+   if (cmp != 0)
+      return cmp;
+   return baseLen - nameLen;
+}
+
+LOCAL int symIndexSortCmp(const void * a, const void * b)
+{
+   const SYM_INDEX_ENTRY * pA = (const SYM_INDEX_ENTRY *) a;
+   const SYM_INDEX_ENTRY * pB = (const SYM_INDEX_ENTRY *) b;
+
+   return symIndexNameCmp (pA->base, pA->baseLen, pB->base, pB->baseLen);
+}
+
+/**
+ * (Re)builds the C++ name index if the symbol table changed since the 
+ * last build. Out of memory, the index is empty and stays out of date, so
+ * the next lookup tries again.
+ */
+LOCAL STATUS symIndexUpdate(SYMTAB_ID symTblId)
+{
+   SYM_INDEX_ENTRY * entries;
+   int               count;
+   int               gen = symCacheGen;
+
+   if (symIndexGen == gen)
+   {
+      return (OK);
+   }
+
+   if (OK != symIndexBuild (symTblId, sizeof (SYM_INDEX_ENTRY), symIndexFill, 
+                            symIndexSortCmp, (void **) &entries, &count))
+   {
+      free (symIndex);
+      symIndex    = NULL;
+      symIndexCnt = 0;
+      luaLog ("C++ name index: out of memory");
+      return (ERROR);
+   }
+
+   free (symIndex);
+   symIndex    = entries;
+   symIndexCnt = count;
+   symIndexGen = gen;
+   return (OK);
+}
+
+/**
+ * Counts the index entries with the given base name, by binary search.
+ * The first match is returned via ppMatch.
+ */
+LOCAL int symIndexFind(const char * name, SYM_INDEX_ENTRY ** ppMatch)
+{
+   int nameLen = strlen (name);
+   int lo = 0;
+   int hi = symIndexCnt;
+   int cnt;
+
+   while (lo < hi)
+   {
+      int mid = lo + (hi - lo) / 2;
+
+      if (symIndexNameCmp (symIndex[mid].base, symIndex[mid].baseLen, name, nameLen) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   for (cnt = 0; lo + cnt < symIndexCnt; cnt++)
+   {
+      if (symIndexNameCmp (symIndex[lo + cnt].base, symIndex[lo + cnt].baseLen, name, nameLen) != 0)
+         break;
+   }
+
+   *ppMatch = (cnt > 0) ? &symIndex[lo] : NULL;
+   return cnt;
+}
+
+#ifdef INCLUDE_SYM_SUBSTR_MATCH
+/* State of one substring search, owned by the searching task */
+typedef struct {
+   char *      substr;     /* substring to match */
+   int         subStrLen;  /* length of substr */
+   int         matchCnt;   /* number of matching symbols */
+   char *      matchVal;   /* value of the last match */
+   SYM_TYPE    matchType;  /* type of the last match */
+} SYM_MATCH_CTX;
 
 LOCAL BOOL symSysTblFindPartMatch
     (
     char *	name,		/* symbol name */
-    int		val,		/* symbol value */
+    char *	val,		/* symbol value */
     INT8	type,		/* symbol type */
-    char *	substr,		/* substring to match */
-    UINT16      group,		/* symbol's module group */
-    SYMBOL *    pSymbol		/* symbol structure */
+    SYM_MATCH_CTX * pCtx,	/* search state */
+    UINT16      group		/* symbol's module group */
     )
 {
-   int         subStrLen = 0;
    char *      symName = name;
    int         ntries	= 0;
 
-   if ( NULL == symName || NULL == substr )
+   if ( NULL == symName )
    {
        return FALSE;
    }
 
-   subStrLen = strlen (substr);
-   ntries    = strlen (symName) - subStrLen;
+   ntries    = strlen (symName) - pCtx->subStrLen;
 
    for (; ntries >= 0; symName++, --ntries)
    {
-       if (strncmp (symName, substr, subStrLen) == 0)
+       if (strncmp (symName, pCtx->substr, pCtx->subStrLen) == 0)
        {
-          matchCnt++;	/* we've found a match */
-          matchSym = pSymbol; 
+          pCtx->matchCnt++;	/* we've found a match */
+          pCtx->matchVal  = val; 
+          pCtx->matchType = type; 
           break;
        }
    }
@@ -221,25 +830,90 @@ LOCAL BOOL symSysTblFindPartMatch
    return (TRUE);
 }
 
+/**
+ * Finds a symbol that contains name, which must be unique.
+ */
+LOCAL STATUS symFindBySubstr(SYMTAB_ID symTblId, char * name, char ** pValue, SYM_TYPE * pType)
+{
+   SYM_MATCH_CTX ctx;
+
+   if ( NULL == name )
+   {
+       return ERROR;
+   }
+
+   ctx.substr    = name;
+   ctx.subStrLen = strlen (name);
+   ctx.matchCnt  = 0;
+   ctx.matchVal  = NULL;
+   ctx.matchType = 0;
+   symEach (symTblId, (FUNCPTR) symSysTblFindPartMatch, (vx_usr_arg_t) &ctx);
+
+   if ( 1 != ctx.matchCnt)
+   {
+#ifdef VERBOSE       
+      printf("Failed - Symbol [%s]: %s\n", name, (0==ctx.matchCnt)?"not found":"not unique");
+#endif
+      return ERROR; 
+   }
+
+   if (pValue != NULL)
+        *pValue = ctx.matchVal;
+    
+   if (pType != NULL)
+        *pType = ctx.matchType;
+
+   return OK;
+}
+#endif /* INCLUDE_SYM_SUBSTR_MATCH */
+
+/**
+ * Finds a C++ function by its unmangled base name, which must be unique.
+ * Without INCLUDE_SYM_SUBSTR_MATCH names that are no C++ base name fail.
+ * Can be called by several tasks at the same time, the index is only locked
+ * for the binary search (and rebuilds).
+ */
 STATUS symFindByName_4cppMangingName(SYMTAB_ID symTblId, char * name, char ** pValue, SYM_TYPE * pType)
 {
-   matchCnt = 0;
-   matchSym = NULL;
-   symEach (symTblId, (FUNCPTR) symSysTblFindPartMatch, (int) name);
+   SYM_INDEX_ENTRY * pMatch;
+   SYM_INDEX_ENTRY   match;
+   int               cnt;
+
+   if (symIndexSem != NULL)
+      semTake (symIndexSem, WAIT_FOREVER);
+   cnt = 0;
+   if (OK == symIndexUpdate (symTblId))
+      cnt = symIndexFind (name, &pMatch);
+   if (cnt == 1)
+      match = *pMatch;   /* the index may be rebuilt after semGive */
+   if (symIndexSem != NULL)
+      semGive (symIndexSem);
+
+   if ( 0 == cnt )
+   {
+#ifdef INCLUDE_SYM_SUBSTR_MATCH
+      return symFindBySubstr (symTblId, name, pValue, pType);
+#else
+#ifdef VERBOSE       
+      printf("Failed - Symbol [%s]: not found\n", name);
+#endif
+      return ERROR; 
+#endif
+   }
 
-   if ( 1 != matchCnt)
+   if ( 1 != cnt )
    {
 #ifdef VERBOSE       
-      printf("Failed - Symbol [%s]: %s\n", name, (0==matchCnt)?"not found":"not unique");
+      printf("Failed - Symbol [%s]: not unique\n", name);
 #endif
       return ERROR; 
    }
 
    if (pValue != NULL)
-        *pValue = (char *) matchSym->value;
+        *pValue = match.value;
     
    if (pType != NULL)
-        *pType = matchSym->type;
+        *pType = match.type;
 
    return OK;
 }
@@ -247,395 +921,5489 @@ STATUS symFindByName_4cppMangingName(SYMTAB_ID symTblId, char * name, char ** pV
 
 typedef int32_t bool_t;
 
-typedef int (*wrap_func)(lua_State*);
+/* Register wide argument word */
+typedef unsigned long arg_word_t;
 
-/* Structure for command table */
+/* Maximum number of arguments of vxDo and vxBind functions */
+#define ARG_MAX_WORDS   32
+
+/* Arguments left out by the caller read as 0 up to this count, like on the
+   shell. Functions are called with exactly as many arguments as are used 
+   beyond it. */
+#define ARG_MIN_WORDS   8
+
+/* Resources that only live for the duration of one call */
 typedef struct {
-  const char *name;
-  wrap_func wrapper;
-} lua_command_info;
+    struct luaScratch * pScratch;   /* scratch arena, NULL if not used */
+    size_t              mark;       /* its fill level before the call */
+    UINT32              cbMask;     /* callback thunks of function arguments */
+    int                 strictArgs; /* numeric strings are passed as strings,
+                                       -1 until the option is looked up */
+} LUA_CALL_SCOPE;
+
+#define LUA_CALL_SCOPE_INIT     { NULL, 0, 0, -1 }
+
+/* Structure for command table */
+typedef luaL_Reg lua_command_info;
 
 /* Forward declares */
 int l_myLuaFunction(lua_State* luaVM);
 int l_ExecuteLuaCommand(lua_State* luaVM);
 int l_vxSet(lua_State* luaVM);
 int l_vxGet(lua_State* luaVM);
+int l_vxBind(lua_State* luaVM);
+int l_vxDoSig(lua_State* luaVM);
+int l_vxDoRet(lua_State* luaVM);
+int l_vxVar(lua_State* luaVM);
+int l_vxRead(lua_State* luaVM);
+int l_vxWrite(lua_State* luaVM);
+int l_vxReadArray(lua_State* luaVM);
+int l_vxWriteArray(lua_State* luaVM);
+int l_vxBuffer(lua_State* luaVM);
+LOCAL char * luaBufferData(lua_State* luaVM, int idx, size_t * pLen);
+int l_vxStruct(lua_State* luaVM);
+LOCAL arg_word_t luaTableToArray(lua_State* luaVM, int idx, LUA_CALL_SCOPE * pScope);
+LOCAL void luaCallScopeEnd(lua_State* luaVM, LUA_CALL_SCOPE * pScope);
+LOCAL arg_word_t luaFunctionToThunk(lua_State* luaVM, int idx, LUA_CALL_SCOPE * pScope);
+LOCAL void cbReleaseMask(lua_State* luaVM, UINT32 mask);
+int l_vxCallback(lua_State* luaVM);
+int l_vxCallbackFree(lua_State* luaVM);
+int l_vxSleep(lua_State* luaVM);
+int l_vxWaitSem(lua_State* luaVM);
+int l_vxWaitMsg(lua_State* luaVM);
+int l_vxSpawn(lua_State* luaVM);
+LOCAL void luaSchedDelete(TSYS_LUA_ID ctx);
+LOCAL int l_luaSnapshot(lua_State* luaVM);
+LOCAL TSYS_LUA_ID luaCtxGet(lua_State* luaVM);
+int l_vxOption(lua_State* luaVM);
+int l_vxStats(lua_State* luaVM);
+int l_vxBatch(lua_State* luaVM);
+int l_vxReg32(lua_State* luaVM);
+int l_vxReg16(lua_State* luaVM);
+int l_vxReg8(lua_State* luaVM);
+int l_vxRegBlock(lua_State* luaVM);
+int l_vxSymbols(lua_State* luaVM);
+LOCAL BOOL luaCtxEnter(TSYS_LUA_ID ctx);
+LOCAL void luaCtxLeave(TSYS_LUA_ID ctx, BOOL entered);
+LOCAL int luaCallFunction(lua_State* luaVM, FUNCPTR function_address, int firstArg, char retType);
+LOCAL int sigInvokeWords(lua_State* luaVM, FUNCPTR fn, arg_word_t * w, int nWords, char retType);
+LOCAL const char * sigCheckRetType(char retType);
+typedef struct sigPlan SIG_PLAN;
+LOCAL SIG_PLAN * sigCacheGetPlan(lua_State* luaVM, int sigIdx);
+LOCAL int sigCall(lua_State* luaVM, FUNCPTR function_address, SIG_PLAN * pPlan, int firstArg);
 /**
  * Function table that will be registered within Lua. 
  */
-static lua_command_info lua_commands[] = 
+static const lua_command_info lua_commands[] = 
 {
     { "myLuaFunction",          l_myLuaFunction         },
     { "vxDo",                   l_ExecuteLuaCommand     },
     { "vxSet",                  l_vxSet                 },
     { "vxGet",                  l_vxGet                 },
+    { "vxBind",                 l_vxBind                },
+    { "vxDoSig",                l_vxDoSig               },
+    { "vxDoRet",                l_vxDoRet               },
+    { "vxVar",                  l_vxVar                 },
+    { "vxRead",                 l_vxRead                },
+    { "vxWrite",                l_vxWrite               },
+    { "vxReadArray",            l_vxReadArray           },
+    { "vxWriteArray",           l_vxWriteArray          },
+    { "vxBuffer",               l_vxBuffer              },
+    { "vxStruct",               l_vxStruct              },
+    { "vxCallback",             l_vxCallback            },
+    { "vxCallbackFree",         l_vxCallbackFree        },
+    { "vxSleep",                l_vxSleep               },
+    { "vxWaitSem",              l_vxWaitSem             },
+    { "vxWaitMsg",              l_vxWaitMsg             },
+    { "vxSpawn",                l_vxSpawn               },
+    { "vxOption",               l_vxOption              },
+    { "vxStats",                l_vxStats               },
+    { "vxBatch",                l_vxBatch               },
+    { "vxReg32",                l_vxReg32               },
+    { "vxReg16",                l_vxReg16               },
+    { "vxReg8",                 l_vxReg8                },
+    { "vxRegBlock",             l_vxRegBlock            },
+    { "vxSymbols",              l_vxSymbols             },
     {0,0}
 };
 
-/* Lua state  */
-static lua_State *luaVM=NULL;
+/* Number of commands */
+#define LUA_COMMAND_COUNT   ((int) (sizeof(lua_commands) / sizeof(lua_commands[0])) - 1)
+
+/* Size of the error message kept per context */
+#define LUA_ERR_BUF_SIZE    256
+
+/* Lua context, one per lua state */
+struct tsysLuaCtx {
+    lua_State *         luaVM;      /* the lua state */
+    struct tsysLuaCtx * pNext;      /* next free context in the pool */
+    struct luaArena *   pArena;     /* private memory, NULL for malloc */
+    SEM_ID              runSem;     /* held by the task running lua code */
+    int                 ownerTid;   /* that task, 0 if there is none */
+    char                errBuf[LUA_ERR_BUF_SIZE];   /* last error message */
+    struct luaSched *   pSched;     /* coroutine scheduler, NULL if unused */
+    int                 options;    /* LUA_OPT_xxx set by vxOption */
+    int                 limitInstr; /* instructions per run, 0 unlimited */
+    int                 limitTicks; /* ticks per run, 0 unlimited */
+    int                 runInstr;   /* instructions of the current run, -1
+                                       between runs */
+    ULONG               runDeadline;/* tickGet() the current run ends */
+    int                 runExceeded;/* LUA_LIMIT_xxx the current run 
+                                       exceeded, 0 if none */
+    int                 gcMode;     /* TSYS_LUA_GC_xxx of TSysLuaSetGcMode */
+};
+
+/* Options of a context */
+#define LUA_OPT_STRICT      0x1     /* failures raise lua errors */
+#define LUA_OPT_STRICT_ARGS 0x2     /* no numeric string conversion */
+
+/* Its address is the registry key of the context of a lua state */
+LOCAL char luaCtxKey;
+
+/* Default context used by TSysStartLua, TSysRunLuaScript and TSysStopLua */
+LOCAL TSYS_LUA_ID luaCtx = NULL;
+
+/****************************************************************************** 
+ * Resolved symbol cache. 
+ *****************************************************************************/
+
+/* Profiling counters of a function */
+typedef struct {
+    UINT32   calls;     /* number of calls */
+    UINT32   hits;      /* lookups answered by the state or shared cache */
+    UINT32   misses;    /* lookups that searched the symbol table */
+    UINT32   partial;   /* misses resolved by partial match */
+    UINT32   timeMax;   /* longest call in timestamp ticks */
+    UINT64   timeSum;   /* all calls in timestamp ticks */
+} SYM_STATS;
+
+/* Cache entry, stored as userdata in the per state cache table */
+typedef struct {
+    char *   value;     /* resolved symbol value */
+    SYM_TYPE type;      /* resolved symbol type */
+    int      gen;       /* symCacheGen at the time of resolution */
+#ifdef INCLUDE_LUA_STATS
+    SYM_STATS stats;    /* profiling counters */
+#endif
+} SYM_CACHE_ENTRY;
+
+#ifdef INCLUDE_LUA_STATS
+#define LUA_STATS_NOW()         sysTimestamp()
+#define LUA_STATS_INC(p, f)     ((p)->stats.f++)
+#else
+#define LUA_STATS_NOW()         0
+#define LUA_STATS_INC(p, f)
+#endif
+
+/* Their addresses are the registry keys of the cache tables of functions 
+   and of global variables */
+LOCAL char symCacheKey;
+LOCAL char varCacheKey;
+
+/* Looks up a symbol name in the system symbol table */
+typedef STATUS (*SYM_LOOKUP_FUNC)(lua_State* luaVM, const char * symName, char ** pValue, 
+                                  SYM_TYPE * pType, BOOL * pPartial);
 
 /**
- * Executes a function called from lua. 
+ * Module create hook, invalidates all cached symbols.
  */
-int l_ExecuteLuaCommand(lua_State* luaVM)
+LOCAL STATUS symCacheModuleHook(MODULE_ID moduleId)
 {
-    int i;
-    FUNCPTR function_address=NULL;
-    int function_status;
-    unsigned int arg[15];  
-    char*    symbol_value;
-    SYM_TYPE symbol_type;
-    int nArgs;
-    char symbol_name[128]="\"no function\"";
-    const char * symName=NULL;
+    symCacheGen++;
+    return OK;
+}
 
-    /* Clear argument list */
-    for (i = 0; i < 15; i++)
+/**
+ * Invalidates all cached symbols of all lua states.
+ * Call this after a module has been unloaded.
+ */
+void TSysLuaSymCacheFlush()
+{
+    symCacheGen++;
+}
+
+/**
+ * Unloads a module by name and invalidates the symbol cache.
+ */
+STATUS TSysLuaUnld(char * name, int options)
+{
+    STATUS status;
+
+    status = unldByName(name, options);
+    TSysLuaSymCacheFlush();
+    return status;
+}
+
+/**
+ * Unloads a module by id and invalidates the symbol cache.
+ */
+STATUS TSysLuaUnldByModuleId(MODULE_ID moduleId, int options)
+{
+    STATUS status;
+
+    status = unldByModuleId(moduleId, options);
+    TSysLuaSymCacheFlush();
+    return status;
+}
+
+/**
+ * Creates the symbol cache tables in the registry of a lua state.
+ */
+LOCAL void symCacheCreate(lua_State* luaVM)
+{
+    lua_pushlightuserdata(luaVM, &symCacheKey);
+    lua_newtable(luaVM);
+    lua_rawset(luaVM, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(luaVM, &varCacheKey);
+    lua_newtable(luaVM);
+    lua_rawset(luaVM, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Looks up a function symbol in the system symbol table. A name with the 
+ * leading underscore is built on the lua stack, so names of any length are
+ * found without a copy into a fixed buffer.
+ */
+LOCAL STATUS symLookupFunction(lua_State* luaVM, const char * symName, char ** pValue, 
+                               SYM_TYPE * pType, BOOL * pPartial)
+{
+    char * symbol_name;
+    STATUS status;
+
+    if (symName == NULL)
     {
-        arg[i] = 0 ;    
+        return ERROR;
     }
+
+/* 
+    On our system, all functions get a leading underscore. 
+    Some other systems (ELF) do not get this leading underscore.
+*/
+#ifdef LEADING_UNDERSCORE    
+    symbol_name = (char *) lua_pushfstring(luaVM, "_%s", symName);
+#else
+    symbol_name = (char *) symName;
+#endif
     
-    nArgs = lua_gettop(luaVM);    
-    
-    if (nArgs>15) nArgs = 15;   /* Clip to max 15 args */
-    
-    /* First argument is always the function name */
-    if(nArgs>=1)
+    status = symFindByName( sysSymTbl,
+    	      symbol_name,
+    	      pValue,
+    	      pType );
+    if ( OK != status )
+    {
+#ifdef INCLUDE_SYM_PART_MATCH
+        status = symFindByName_4cppMangingName( sysSymTbl,
+    	           (char *) symName,
+    	           pValue,
+    	           pType );
+        *pPartial = (status == OK);
+#endif
+    }
+#ifdef LEADING_UNDERSCORE    
+    lua_pop(luaVM, 1);
+#endif
+    return status;
+}
+
+/**
+ * Looks up a global variable in the system symbol table. 
+ * Both symbols with and without underscore are possible because type N_BSS 
+ * does not need an underscore but a N_DATA does needs an underscore.
+ */
+LOCAL STATUS symLookupVariable(lua_State* luaVM, const char * symName, char ** pValue, 
+                               SYM_TYPE * pType, BOOL * pPartial)
+{
+    char * symbol_name;
+    STATUS status;
+
+    if (symName == NULL)
+    {
+        return ERROR;
+    }
+
+    if ( OK == symFindByName( sysSymTbl, (char *) symName, pValue, pType ) )
+    {
+        return OK;
+    }
+
+    /* Try again with underscore */
+    symbol_name = (char *) lua_pushfstring(luaVM, "_%s", symName);
+    status = symFindByName( sysSymTbl, symbol_name, pValue, pType );
+    lua_pop(luaVM, 1);
+    return status;
+}
+
+/* Slots of the shared symbol cache, a power of 2, and the slots probed */
+#define SYM_SHARED_SIZE     1024
+#define SYM_SHARED_PROBES   16
+
+/* Resolved symbol shared by all lua states, never changed once published */
+typedef struct symSharedRec {
+    struct symSharedRec * pNext;    /* next retired record */
+    SYM_LOOKUP_FUNC lookup;         /* lookup that resolved it */
+    char *          value;          /* resolved symbol value */
+    SYM_TYPE        type;           /* resolved symbol type */
+    int             gen;            /* symCacheGen at the time of resolution */
+    UINT32          hash;           /* hash of name */
+    char            name[1];        /* symbol name, allocated with the record */
+} SYM_SHARED_REC;
+
+/* Open addressed hash of records. Readers do not lock, writers take 
+   symSharedSem and publish a record by one pointer store. Replaced records
+   may still be read, so they are retired. Readers count themselves in the
+   counter of the current epoch. To reclaim, the retired records wait while
+   the epoch is advanced, and are freed when the counter of the previous 
+   epoch drops to 0: every reader that could have seen them is done then. */
+LOCAL SYM_SHARED_REC * volatile symShared[SYM_SHARED_SIZE];
+LOCAL SYM_SHARED_REC *          symSharedRetired = NULL;   /* replaced */
+LOCAL SYM_SHARED_REC *          symSharedWaiting = NULL;   /* wait for readers */
+LOCAL volatile int              symSharedEpoch   = 0;
+LOCAL lua_atomic_t              symSharedReaders[2];       /* by epoch & 1 */
+LOCAL SEM_ID                    symSharedSem = NULL;
+
+/**
+ * Returns the hash of a symbol name.
+ */
+LOCAL UINT32 symSharedHash(const char * name)
+{
+    UINT32 hash = 2166136261u;      /* FNV-1a */
+
+    while (*name)
+    {
+        hash = (hash ^ (UINT8) *name++) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Frees the retired records that no reader can see anymore and starts the
+ * grace period of the others. Called with symSharedSem taken.
+ */
+LOCAL void symSharedReclaim()
+{
+    SYM_SHARED_REC * pRec;
+
+    LUA_MEM_BARRIER();      /* records unlinked before the counters are read */
+    if (symSharedWaiting != NULL && 
+        luaAtomicAdd(&symSharedReaders[(symSharedEpoch - 1) & 1], 0) == 0)
+    {
+        while ((pRec = symSharedWaiting) != NULL)
+        {
+            symSharedWaiting = pRec->pNext;
+            free(pRec);
+        }
+    }
+    if (symSharedWaiting == NULL && symSharedRetired != NULL)
+    {
+        symSharedWaiting = symSharedRetired;
+        symSharedRetired = NULL;
+        symSharedEpoch++;
+        LUA_MEM_BARRIER();
+    }
+}
+
+/**
+ * Looks up a symbol resolved by lookup in generation gen in the shared 
+ * cache. Does not lock, can be called by all lua states at the same time.
+ */
+LOCAL STATUS symSharedFind(SYM_LOOKUP_FUNC lookup, const char * name, int gen, 
+                           char ** pValue, SYM_TYPE * pType)
+{
+    UINT32           hash = symSharedHash(name);
+    SYM_SHARED_REC * pRec;
+    STATUS           status = ERROR;
+    int              epoch;
+    int              i;
+
+    /* Counted in the epoch that is current, before the slots are read */
+    for (;;)
+    {
+        epoch = symSharedEpoch;
+        luaAtomicAdd(&symSharedReaders[epoch & 1], 1);
+        LUA_MEM_BARRIER();
+        if (epoch == symSharedEpoch)
+        {
+            break;
+        }
+        luaAtomicAdd(&symSharedReaders[epoch & 1], -1);
+    }
+    for (i = 0; i < SYM_SHARED_PROBES; i++)
+    {
+        pRec = symShared[(hash + i) & (SYM_SHARED_SIZE - 1)];
+        if (pRec == NULL)
+        {
+            break;
+        }
+        if (pRec->hash == hash && pRec->lookup == lookup && 
+            strcmp(pRec->name, name) == 0)
+        {
+            if (pRec->gen == gen)
+            {
+                *pValue = pRec->value;
+                *pType  = pRec->type;
+                status  = OK;
+            }
+            break;          /* a stale one is resolved again */
+        }
+    }
+    LUA_MEM_BARRIER();
+    luaAtomicAdd(&symSharedReaders[epoch & 1], -1);
+
+    /* Readers complete the grace period when no symbols are added */
+    if ((symSharedWaiting != NULL || symSharedRetired != NULL) &&
+        OK == semTake(symSharedSem, NO_WAIT))
+    {
+        symSharedReclaim();
+        semGive(symSharedSem);
+    }
+    return status;
+}
+
+/**
+ * Publishes a symbol resolved by lookup in generation gen to the shared 
+ * cache. It replaces the record of the name or a stale one or takes a free
+ * slot, when all probed slots hold other valid names it is not shared.
+ */
+LOCAL void symSharedAdd(SYM_LOOKUP_FUNC lookup, const char * name, int gen, 
+                        char * value, SYM_TYPE type)
+{
+    UINT32           hash = symSharedHash(name);
+    SYM_SHARED_REC * pRec;
+    SYM_SHARED_REC * pOld;
+    int              slot;
+    int              i;
+
+    if (symSharedSem == NULL)
+    {
+        return;
+    }
+
+    pRec = (SYM_SHARED_REC *) malloc(sizeof(SYM_SHARED_REC) + strlen(name));
+    if (pRec == NULL)
+    {
+        return;
+    }
+    pRec->pNext  = NULL;
+    pRec->lookup = lookup;
+    pRec->value  = value;
+    pRec->type   = type;
+    pRec->gen    = gen;
+    pRec->hash   = hash;
+    strcpy(pRec->name, name);
+
+    semTake(symSharedSem, WAIT_FOREVER);
+    for (i = 0; i < SYM_SHARED_PROBES; i++)
+    {
+        slot = (hash + i) & (SYM_SHARED_SIZE - 1);
+        pOld = symShared[slot];
+        if (pOld == NULL || pOld->gen != symCacheGen || 
+            (pOld->hash == hash && pOld->lookup == lookup && strcmp(pOld->name, name) == 0))
+        {
+            LUA_MEM_BARRIER();      /* the record before its pointer */
+            symShared[slot] = pRec;
+            if (pOld != NULL)
+            {
+                pOld->pNext      = symSharedRetired;
+                symSharedRetired = pOld;
+            }
+            pRec = NULL;
+            break;
+        }
+    }
+    symSharedReclaim();
+    semGive(symSharedSem);
+    free(pRec);     /* not shared */
+}
+
+/**
+ * Frees all records of the shared cache. Only called when no lua state 
+ * exists anymore, so nobody reads them.
+ */
+LOCAL void symSharedFree()
+{
+    SYM_SHARED_REC * pRec;
+    int              i;
+
+    for (i = 0; i < SYM_SHARED_SIZE; i++)
+    {
+        free(symShared[i]);
+        symShared[i] = NULL;
+    }
+    while ((pRec = symSharedRetired) != NULL)
+    {
+        symSharedRetired = pRec->pNext;
+        free(pRec);
+    }
+    while ((pRec = symSharedWaiting) != NULL)
+    {
+        symSharedWaiting = pRec->pNext;
+        free(pRec);
+    }
+}
+
+/**
+ * Resolves the symbol name at stack index nameIdx (positive or upvalue
+ * index) and pushes its up to date entry of the cache table cacheKey onto 
+ * the lua stack. The cache of the lua state is tried first, then the cache
+ * shared by all states, the symbol table is only searched by lookup when 
+ * both miss or are stale.
+ * Returns NULL, with nothing pushed, if the symbol does not exist.
+ */
+LOCAL SYM_CACHE_ENTRY * symCacheGetEntryEx(lua_State* luaVM, int nameIdx, 
+                                           void * cacheKey, SYM_LOOKUP_FUNC lookup)
+{
+    SYM_CACHE_ENTRY * pEntry;
+    char*    symbol_value;
+    SYM_TYPE symbol_type;
+    BOOL     partial = FALSE;
+    int gen = symCacheGen;
+
+    if (!lua_isstring(luaVM, nameIdx))
+    {
+        return NULL;
+    }
+
+    lua_pushlightuserdata(luaVM, cacheKey);
+    lua_rawget(luaVM, LUA_REGISTRYINDEX);
+    lua_pushvalue(luaVM, nameIdx);
+    lua_rawget(luaVM, -2);
+    pEntry = (SYM_CACHE_ENTRY *) lua_touserdata(luaVM, -1);
+
+    if (pEntry == NULL || pEntry->gen != gen)
+    {
+        const char * name = lua_tostring(luaVM, nameIdx);
+        BOOL         shared;
+
+        shared = (OK == symSharedFind(lookup, name, gen, &symbol_value, &symbol_type));
+        if (!shared)
+        {
+            if (OK != (*lookup)(luaVM, name, &symbol_value, &symbol_type, &partial))
+            {
+                lua_pop(luaVM, 2);
+                return NULL;
+            }
+            symSharedAdd(lookup, name, gen, symbol_value, symbol_type);
+        }
+        if (pEntry == NULL)
+        {
+            lua_pop(luaVM, 1);
+            lua_pushvalue(luaVM, nameIdx);
+            pEntry = (SYM_CACHE_ENTRY *) lua_newuserdata(luaVM, sizeof(SYM_CACHE_ENTRY));
+            memset(pEntry, 0, sizeof(SYM_CACHE_ENTRY));
+            lua_pushvalue(luaVM, -1);
+            lua_insert(luaVM, -3);              /* cache[name] = entry */
+            lua_rawset(luaVM, -4);
+        }
+        pEntry->value = symbol_value;
+        pEntry->type  = symbol_type;
+        pEntry->gen   = gen;
+        if (shared)
+        {
+            LUA_STATS_INC(pEntry, hits);
+        }
+        else
+        {
+            LUA_STATS_INC(pEntry, misses);
+        }
+        if (partial)
+        {
+            LUA_STATS_INC(pEntry, partial);
+        }
+    }
+    else
+    {
+        LUA_STATS_INC(pEntry, hits);
+    }
+
+    lua_replace(luaVM, -2);                     /* entry replaces the table */
+    return pEntry;
+}
+
+/**
+ * Resolves the function name at stack index nameIdx and pushes its up to 
+ * date cache entry onto the lua stack. 
+ * Returns NULL, with nothing pushed, if the function does not exist.
+ */
+LOCAL SYM_CACHE_ENTRY * symCacheGetEntry(lua_State* luaVM, int nameIdx)
+{
+    return symCacheGetEntryEx(luaVM, nameIdx, &symCacheKey, symLookupFunction);
+}
+
+/**
+ * Resolves the global variable name at stack index nameIdx via the variable
+ * cache. Returns the address of the variable or NULL.
+ */
+LOCAL char * symCacheFindVariable(lua_State* luaVM, int nameIdx)
+{
+    SYM_CACHE_ENTRY * pEntry;
+
+    pEntry = symCacheGetEntryEx(luaVM, nameIdx, &varCacheKey, symLookupVariable);
+    if (pEntry == NULL)
+    {
+        return NULL;
+    }
+    lua_pop(luaVM, 1);
+    return pEntry->value;
+}
+
+/**
+ * Resolves the function name at stack index nameIdx via the symbol cache.
+ * Returns its cache entry, which the cache keeps alive, or NULL.
+ */
+LOCAL SYM_CACHE_ENTRY * symCacheFindFunction(lua_State* luaVM, int nameIdx)
+{
+    SYM_CACHE_ENTRY * pEntry;
+
+    pEntry = symCacheGetEntry(luaVM, nameIdx);
+    if (pEntry != NULL)
+    {
+        lua_pop(luaVM, 1);
+    }
+    return pEntry;
+}
+
+#ifdef INCLUDE_LUA_STATS
+LOCAL UINT32 luaStatsPeriod = 0;        /* sysTimestampPeriod() */
+
+/**
+ * Counts a call of the function of a cache entry that started at 
+ * timestamp t0.
+ */
+LOCAL void luaStatsCall(SYM_CACHE_ENTRY * pEntry, UINT32 t0)
+{
+    UINT32 t1 = sysTimestamp();
+    UINT32 dt = (t1 >= t0) ? t1 - t0 : t1 + (luaStatsPeriod - t0);
+
+    pEntry->stats.calls++;
+    pEntry->stats.timeSum += dt;
+    if (dt > pEntry->stats.timeMax)
+    {
+        pEntry->stats.timeMax = dt;
+    }
+}
+#define LUA_STATS_CALL(pEntry, t0)  luaStatsCall(pEntry, t0)
+#else
+#define LUA_STATS_CALL(pEntry, t0)
+#endif
+
+/**
+ * Reports a failed call: logs the message and returns nil, errCode, msg to
+ * lua, or raises it as lua error in strict mode. 
+ * Use as return luaFail(luaVM, errCode, fmt, ...), fmt as lua_pushfstring.
+ */
+LOCAL int luaFail(lua_State* luaVM, int errCode, const char * fmt, ...)
+{
+    TSYS_LUA_ID  ctx = luaCtxGet(luaVM);
+    const char * msg;
+    va_list      args;
+
+    va_start(args, fmt);
+    msg = lua_pushvfstring(luaVM, fmt, args);
+    va_end(args);
+    luaLog("%s", msg);
+
+    if (ctx != NULL && (ctx->options & LUA_OPT_STRICT))
+    {
+        luaL_where(luaVM, 1);
+        lua_insert(luaVM, -2);
+        lua_concat(luaVM, 2);
+        return lua_error(luaVM);
+    }
+
+    lua_pushnil(luaVM);
+    lua_insert(luaVM, -2);
+    lua_pushnumber(luaVM, errCode);
+    lua_insert(luaVM, -2);
+    return 3;   /* nil, errCode, msg */
+}
+
+/**
+ * Reports a symbol (kind is "Function" or "Variable") at stack index 
+ * nameIdx that could not be resolved. The errno of the symbol table lookup
+ * is the error code.
+ */
+LOCAL int luaSymFail(lua_State* luaVM, int nameIdx, const char * kind)
+{
+    const char * name = lua_tostring(luaVM, nameIdx);
+    int          err  = errnoGet();
+
+    if (name == NULL)
+    {
+        return luaFail(luaVM, err, "%s name expected", kind);
+    }
+#ifdef INCLUDE_SYM_PART_MATCH
+    return luaFail(luaVM, err, "%s %s does not exist or not unique", kind, name);
+#else
+    return luaFail(luaVM, err, "%s %s does not exist", kind, name);
+#endif
+}
+
+/**
+ * Sets or gets an option of the lua context, returns its previous value.
+ * old = vxOption("strict" [, true])
+ *   strict      failures of calls raise lua errors instead of returning 
+ *               nil, errcode, msg
+ *   strictargs  strings are always passed as char *, also numeric ones 
+ *               like "100"
+ */
+int l_vxOption(lua_State* luaVM)
+{
+    TSYS_LUA_ID  ctx  = luaCtxGet(luaVM);
+    const char * name = luaL_checkstring(luaVM, 1);
+    int          opt;
+
+    if (strcmp(name, "strict") == 0)
+    {
+        opt = LUA_OPT_STRICT;
+    }
+    else if (strcmp(name, "strictargs") == 0)
+    {
+        opt = LUA_OPT_STRICT_ARGS;
+    }
+    else
+    {
+        return luaL_argerror(luaVM, 1, "unknown option");
+    }
+
+    lua_pushboolean(luaVM, (ctx->options & opt) != 0);
+    if (!lua_isnone(luaVM, 2))
+    {
+        if (lua_toboolean(luaVM, 2))
+            ctx->options |= opt;
+        else
+            ctx->options &= ~opt;
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Pushes the counters of the function cache entry on top of the stack as 
+ * table { calls, hits, misses, partial, time, max }, times in 
+ * microseconds, and replaces the entry by it.
+ */
+LOCAL void luaStatsPush(lua_State* luaVM)
+{
+    lua_newtable(luaVM);
+#ifdef INCLUDE_LUA_STATS
+    {
+        SYM_CACHE_ENTRY * pEntry = (SYM_CACHE_ENTRY *) lua_touserdata(luaVM, -2);
+        double usPerTick = 1e6 / (double) sysTimestampFreq();
+
+#define LUA_STATS_FIELD(name, val) \
+        lua_pushstring(luaVM, name); lua_pushnumber(luaVM, val); lua_rawset(luaVM, -3)
+        LUA_STATS_FIELD("calls",   pEntry->stats.calls);
+        LUA_STATS_FIELD("hits",    pEntry->stats.hits);
+        LUA_STATS_FIELD("misses",  pEntry->stats.misses);
+        LUA_STATS_FIELD("partial", pEntry->stats.partial);
+        LUA_STATS_FIELD("time",    (double) pEntry->stats.timeSum * usPerTick);
+        LUA_STATS_FIELD("max",     pEntry->stats.timeMax * usPerTick);
+#undef LUA_STATS_FIELD
+    }
+#endif
+    lua_replace(luaVM, -2);
+}
+
+/**
+ * Returns the profiling counters of all functions called by name, and 
+ * clears them if reset is true, and the memory used by lua in KB.
+ * stats, memKb = vxStats([reset])
+ * print(stats["my_c_function"].calls, stats["my_c_function"].time)
+ */
+int l_vxStats(lua_State* luaVM)
+{
+    BOOL reset = lua_toboolean(luaVM, 1);
+
+    lua_newtable(luaVM);
+    lua_pushlightuserdata(luaVM, &symCacheKey);
+    lua_rawget(luaVM, LUA_REGISTRYINDEX);
+    lua_pushnil(luaVM);
+    while (lua_next(luaVM, -2))
+    {
+        lua_pushvalue(luaVM, -2);       /* name */
+        lua_insert(luaVM, -2);
+        if (reset)
+        {
+#ifdef INCLUDE_LUA_STATS
+            SYM_CACHE_ENTRY * pEntry = (SYM_CACHE_ENTRY *) lua_touserdata(luaVM, -1);
+            luaStatsPush(luaVM);
+            memset(&pEntry->stats, 0, sizeof(SYM_STATS));
+#else
+            luaStatsPush(luaVM);
+#endif
+        }
+        else
+        {
+            luaStatsPush(luaVM);
+        }
+        lua_rawset(luaVM, -5);          /* stats[name] = counters */
+    }
+    lua_pop(luaVM, 1);
+    lua_pushnumber(luaVM, luaMemKb(luaVM));
+    return 2;   /* Two values pushed onto the lua stack */	
+}
+
+/**
+ * Prints the profiling counters of all functions called in a context.
+ */
+void TSysLuaDumpStats(TSYS_LUA_ID ctx)
+{
+    lua_State *       luaVM;
+    BOOL              entered;
+#ifdef INCLUDE_LUA_STATS
+    SYM_CACHE_ENTRY * pEntry;
+    double            usPerTick = 1e6 / (double) sysTimestampFreq();
+#endif
+
+    if (ctx == NULL)
+    {
+        printf("TSysLuaDumpStats(): Lua not initialized!\n");
+        return;
+    }
+
+    entered = luaCtxEnter(ctx);
+    luaVM   = ctx->luaVM;
+    printf("memory: %.1f KB\n", luaMemKb(luaVM));
+#ifdef INCLUDE_LUA_STATS
+    printf("%10s %8s %8s %8s %12s %10s  %s\n", 
+           "calls", "hits", "misses", "partial", "time[us]", "max[us]", "function");
+    lua_pushlightuserdata(luaVM, &symCacheKey);
+    lua_rawget(luaVM, LUA_REGISTRYINDEX);
+    lua_pushnil(luaVM);
+    while (lua_next(luaVM, -2))
+    {
+        pEntry = (SYM_CACHE_ENTRY *) lua_touserdata(luaVM, -1);
+        printf("%10u %8u %8u %8u %12.0f %10.1f  %s\n", 
+               (unsigned int) pEntry->stats.calls, (unsigned int) pEntry->stats.hits,
+               (unsigned int) pEntry->stats.misses, (unsigned int) pEntry->stats.partial,
+               (double) pEntry->stats.timeSum * usPerTick, 
+               pEntry->stats.timeMax * usPerTick, lua_tostring(luaVM, -2));
+        lua_pop(luaVM, 1);
+    }
+    lua_pop(luaVM, 1);
+#else
+    printf("TSysLuaDumpStats(): INCLUDE_LUA_STATS is not defined\n");
+#endif
+    luaCtxLeave(ctx, entered);
+}
+
+/**
+ * Executes a function called from lua. 
+ */
+int l_ExecuteLuaCommand(lua_State* luaVM)
+{
+    SYM_CACHE_ENTRY * pEntry;
+    UINT32            t0;
+    int               nResults;
+
+#ifdef VERBOSE       
+    printf("Function name : %s\n", lua_tostring(luaVM, 1));
+#endif
+
+    pEntry = symCacheFindFunction( luaVM, 1 );
+    if ( NULL == pEntry )
+    {
+        return luaSymFail(luaVM, 1, "Function");
+    }
+
+    t0 = LUA_STATS_NOW();
+    nResults = luaCallFunction(luaVM, (FUNCPTR) pEntry->value, 2, 'w');
+    LUA_STATS_CALL(pEntry, t0);
+    return nResults;
+}
+
+/**
+ * Executes a function called from lua and converts the result to the given
+ * return type character (see vxDoSig).
+ * pointer = vxDoRet("p", "malloc", 100)
+ */
+int l_vxDoRet(lua_State* luaVM)
+{
+    SYM_CACHE_ENTRY * pEntry;
+    UINT32       t0;
+    int          nResults;
+    size_t       len;
+    const char * ret = luaL_checklstring(luaVM, 1, &len);
+    const char * err;
+
+    err = (len == 1) ? sigCheckRetType(ret[0]) : "invalid return type";
+    if (err != NULL)
+    {
+        return luaL_argerror(luaVM, 1, err);
+    }
+
+    pEntry = symCacheFindFunction( luaVM, 2 );
+    if ( NULL == pEntry )
+    {
+        return luaSymFail(luaVM, 2, "Function");
+    }
+
+    t0 = LUA_STATS_NOW();
+    nResults = luaCallFunction(luaVM, (FUNCPTR) pEntry->value, 3, ret[0]);
+    LUA_STATS_CALL(pEntry, t0);
+    return nResults;
+}
+
+/**
+ * Returns the up to date cache entry of a function returned by vxBind, or 
+ * NULL. Upvalue 1 is the symbol cache entry, upvalue 2 the function name.
+ */
+LOCAL SYM_CACHE_ENTRY * luaBoundEntry(lua_State* luaVM)
+{
+    SYM_CACHE_ENTRY * pEntry;
+
+    pEntry = (SYM_CACHE_ENTRY *) lua_touserdata(luaVM, lua_upvalueindex(1));
+    if (pEntry->gen == symCacheGen)
+    {
+        return pEntry;
+    }
+
+    /* Symbol table changed since binding, this refreshes pEntry as well */
+    return symCacheFindFunction( luaVM, lua_upvalueindex(2) );
+}
+
+/**
+ * Calls a function returned by vxBind. 
+ */
+int l_vxBoundCall(lua_State* luaVM)
+{
+    SYM_CACHE_ENTRY * pEntry = luaBoundEntry(luaVM);
+    UINT32            t0;
+    int               nResults;
+
+    if (pEntry == NULL)
+    {
+        return luaSymFail(luaVM, lua_upvalueindex(2), "Function");
+    }
+    t0 = LUA_STATS_NOW();
+    nResults = luaCallFunction(luaVM, (FUNCPTR) pEntry->value, 1, 'w');
+    LUA_STATS_CALL(pEntry, t0);
+    return nResults;
+}
+
+/**
+ * Calls a function returned by vxBind with a signature. 
+ * Upvalue 3 is the compiled signature.
+ */
+int l_vxBoundSigCall(lua_State* luaVM)
+{
+    SYM_CACHE_ENTRY * pEntry = luaBoundEntry(luaVM);
+    UINT32            t0;
+    int               nResults;
+
+    if (pEntry == NULL)
+    {
+        return luaSymFail(luaVM, lua_upvalueindex(2), "Function");
+    }
+    t0 = LUA_STATS_NOW();
+    nResults = sigCall(luaVM, (FUNCPTR) pEntry->value, 
+                       (SIG_PLAN *) lua_touserdata(luaVM, lua_upvalueindex(3)), 1);
+    LUA_STATS_CALL(pEntry, t0);
+    return nResults;
+}
+
+/**
+ * Resolves a function once and returns a lua function calling it directly.
+ * An optional signature (see vxDoSig) types the arguments and the result.
+ * f = vxBind("my_c_function")
+ * result = f(1, 2, 5)
+ * atan2 = vxBind("atan2", "dd>d")
+ */
+int l_vxBind(lua_State* luaVM)
+{
+    BOOL withSig = !lua_isnoneornil(luaVM, 2);
+
+    if (withSig)
+    {
+        sigCacheGetPlan(luaVM, 2);      /* checks the signature first */
+        lua_pop(luaVM, 1);
+    }
+
+    if ( NULL == symCacheGetEntry( luaVM, 1 ) )
+    {
+        return luaSymFail(luaVM, 1, "Function");
+    }
+
+    lua_pushvalue(luaVM, 1);
+    if (withSig)
+    {
+        sigCacheGetPlan(luaVM, 2);
+        lua_pushcclosure(luaVM, l_vxBoundSigCall, 3);
+    }
+    else
+    {
+        lua_pushcclosure(luaVM, l_vxBoundCall, 2);
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Returns TRUE if numeric strings are passed as strings in the call. The
+ * option is looked up at the first numeric string of the call, calls 
+ * without them do not pay for it.
+ */
+LOCAL BOOL luaArgStrict(lua_State* luaVM, LUA_CALL_SCOPE * pScope)
+{
+    TSYS_LUA_ID ctx;
+
+    if (pScope == NULL)
+    {
+        return FALSE;
+    }
+    if (pScope->strictArgs < 0)
+    {
+        ctx = luaCtxGet(luaVM);
+        pScope->strictArgs = (ctx != NULL && (ctx->options & LUA_OPT_STRICT_ARGS) != 0);
+    }
+    return pScope->strictArgs;
+}
+
+/* Number to argument word, integral numbers keep all bits of the word */
+#ifdef LUA_5_2
+#define luaArgNumber(L,i)   ((arg_word_t) lua_tointeger(L,i))
+#else
+#define luaArgNumber(L,i)   ((arg_word_t) (int32_t) lua_tonumber(L,i))
+#endif
+
+/**
+ * Converts the lua value at stack index idx into an argument word. 
+ * Memory needed for the argument is released by luaCallScopeEnd(pScope), 
+ * pScope NULL passes tables as NULL.
+ * Numeric strings are passed as numbers unless the strictargs option is set.
+ */
+LOCAL arg_word_t luaArgToWord(lua_State* luaVM, int idx, LUA_CALL_SCOPE * pScope)
+{
+#ifdef LUA_ARG_CHAIN
+    if(lua_isnil(luaVM, idx))
+    {
+        return 0;
+    }
+    else if(lua_isboolean(luaVM, idx))
+    {
+        return (bool_t) lua_toboolean(luaVM, idx);
+    }
+    else if(lua_isnumber(luaVM, idx))
+    {
+        return (int32_t) lua_tonumber(luaVM, idx);
+    }
+    else if(lua_isstring(luaVM, idx))
+    {
+        return (arg_word_t) lua_tostring(luaVM, idx);
+    }
+    else if(lua_istable(luaVM, idx))
+    {
+        return (pScope != NULL) ? luaTableToArray(luaVM, idx, pScope) : 0;
+    }
+    else if(lua_isfunction(luaVM, idx))
+    {
+        return (pScope != NULL && !lua_iscfunction(luaVM, idx)) ? 
+               luaFunctionToThunk(luaVM, idx, pScope) : 0;
+    }
+    else if(lua_islightuserdata(luaVM, idx))
+    {
+        return (arg_word_t) lua_touserdata(luaVM, idx);
+    }
+    else if(lua_isuserdata(luaVM, idx))
+    {
+        return (arg_word_t) luaBufferData(luaVM, idx, NULL);
+    }
+    return 0;
+#else
+    int type = lua_type(luaVM, idx);
+
+#ifdef VERBOSE        
+    printf("arg %d: %s type is %s\n", idx, lua_tostring(luaVM, idx), 
+           lua_typename(luaVM, type));
+#endif
+    /* Most frequent types first */
+    switch (type)
+    {
+    case LUA_TNUMBER:
+        return luaArgNumber(luaVM, idx);
+
+    case LUA_TSTRING:
+        if (lua_isnumber(luaVM, idx) && !luaArgStrict(luaVM, pScope))
+        {
+            return luaArgNumber(luaVM, idx);
+        }
+        return (arg_word_t) lua_tostring(luaVM, idx);
+
+    case LUA_TLIGHTUSERDATA:
+        /* A pointer returned by vxDoRet("p", ...) */
+        return (arg_word_t) lua_touserdata(luaVM, idx);
+
+    case LUA_TBOOLEAN:
+        return (bool_t) lua_toboolean(luaVM, idx);
+
+    case LUA_TUSERDATA:
+        /* The storage of a vxBuffer, other userdata is not supported yet */
+        return (arg_word_t) luaBufferData(luaVM, idx, NULL);
+
+    case LUA_TTABLE:
+        /* The array part as C array in the scratch arena */
+        return (pScope != NULL) ? luaTableToArray(luaVM, idx, pScope) : 0;
+
+    case LUA_TFUNCTION:
+        /* A callback thunk for the duration of the call, C functions are 
+           not supported yet */
+        if (pScope == NULL || lua_iscfunction(luaVM, idx))
+        {
+            return 0;
+        }
+        return luaFunctionToThunk(luaVM, idx, pScope);
+
+    default:
+        /* nil, none and unsupported types */
+        return 0;
+    }
+#endif
+}
+
+/**
+ * Executes a function with the lua arguments from index firstArg on and 
+ * pushes the result converted to retType (see vxDoSig).
+ */
+LOCAL int luaCallFunction(lua_State* luaVM, FUNCPTR function_address, int firstArg, char retType)
+{
+    int i;
+    arg_word_t arg[ARG_MAX_WORDS];  
+    int nArgs;
+    int nWords;
+    int nResults;
+    LUA_CALL_SCOPE scope = LUA_CALL_SCOPE_INIT;
+
+    nArgs = lua_gettop(luaVM) - firstArg + 1;    
+    if (nArgs < 0) nArgs = 0;
+    if (nArgs > ARG_MAX_WORDS)
+    {
+        return luaL_error(luaVM, "too many arguments (%d, max %d)", nArgs, ARG_MAX_WORDS);
+    }
+    
+#ifdef VERBOSE       
+    printf("Number of args: %d\n", nArgs);
+#endif
+    
+    /* Process the function arguments, clear only the unused minimum ones */
+    for(i=0; i<nArgs; i++)
+    {
+        arg[i] = luaArgToWord(luaVM, firstArg + i, &scope);
+    }
+    for(nWords = nArgs; nWords < ARG_MIN_WORDS; nWords++)
+    {
+        arg[nWords] = 0;
+    }
+  
+    nResults = sigInvokeWords(luaVM, function_address, arg, nWords, retType);
+    luaCallScopeEnd(luaVM, &scope);
+    return nResults;
+}
+
+
+/****************************************************************************** 
+ * Symbol enumeration. 
+   vxSymbols(prefix [, type]) iterates over all symbols starting with prefix
+   by binary search in an index of all symbol names, sorted by name. The 
+   index is built on the first use and again after the symbol table changed.
+   type selects "text", "data", "bss" or "abs" symbols, or is a SYM_TYPE 
+   number; the external bit is ignored.
+     for name, addr, type in vxSymbols("drvX_", "text") do
+        vxDo(name)
+     end
+ *****************************************************************************/
+
+/* Entry of the symbol name index */
+typedef struct {
+    const char * name;      /* symbol name, owned by the symbol table */
+    char *       value;     /* symbol value */
+    SYM_TYPE     type;      /* symbol type */
+} SYM_NAME_ENTRY;
+
+LOCAL SYM_NAME_ENTRY * symNames    = NULL;
+LOCAL int              symNameCnt  = 0;
+LOCAL int              symNameGen  = -1;    /* symCacheGen of the index */
+LOCAL SEM_ID           symNameSem  = NULL;  /* guards the index */
+
+/**
+ * Fills an entry of the name index.
+ */
+LOCAL BOOL symNameFill(void * p, char * name, char * val, SYM_TYPE type)
+{
+    SYM_NAME_ENTRY * pEntry = (SYM_NAME_ENTRY *) p;
+
+    pEntry->name  = name;
+    pEntry->value = val;
+    pEntry->type  = type;
+    return TRUE;
+}
+
+LOCAL int symNameSortCmp(const void * a, const void * b)
+{
+    return strcmp(((const SYM_NAME_ENTRY *) a)->name, ((const SYM_NAME_ENTRY *) b)->name);
+}
+
+/**
+ * (Re)builds the name index if the symbol table changed since the last 
+ * build. Called with symNameSem taken. Out of memory, the index is empty
+ * and stays out of date, so the next use tries again.
+ */
+LOCAL STATUS symNameUpdate()
+{
+    SYM_NAME_ENTRY * entries;
+    int              count;
+    int              gen = symCacheGen;
+
+    if (symNameGen == gen)
+    {
+        return OK;
+    }
+
+    if (OK != symIndexBuild(sysSymTbl, sizeof(SYM_NAME_ENTRY), symNameFill, 
+                            symNameSortCmp, (void **) &entries, &count))
+    {
+        free(symNames);
+        symNames   = NULL;
+        symNameCnt = 0;
+        luaLog("vxSymbols: out of memory for the name index");
+        return ERROR;
+    }
+
+    free(symNames);
+    symNames   = entries;
+    symNameCnt = count;
+    symNameGen = gen;
+    return OK;
+}
+
+/**
+ * Copies the symbols starting with prefix of type (-1 for all) into one 
+ * malloc'ed block: the entries followed by their names. Returns the block
+ * and the number of entries in *pCount, NULL if there are none. Out of 
+ * memory *pCount is -1. The index is only locked while copying, so no lua
+ * error can leave it locked.
+ */
+LOCAL SYM_NAME_ENTRY * symNameCopy(const char * prefix, int type, int * pCount)
+{
+    SYM_NAME_ENTRY * pCopy = NULL;
+    char *           pName;
+    size_t           prefixLen = strlen(prefix);
+    size_t           size = 0;
+    int              first;
+    int              lo = 0;
+    int              hi;
+    int              i;
+    int              n = 0;
+
+    semTake(symNameSem, WAIT_FOREVER);
+    if (OK != symNameUpdate())
+    {
+        semGive(symNameSem);
+        *pCount = -1;
+        return NULL;
+    }
+
+    /* The first name not less than prefix, matches follow it */
+    hi = symNameCnt;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (strcmp(symNames[mid].name, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    first = lo;
+
+    for (i = first; i < symNameCnt && strncmp(symNames[i].name, prefix, prefixLen) == 0; i++)
+    {
+        if (type < 0 || (symNames[i].type & ~N_EXT) == type)
+        {
+            size += sizeof(SYM_NAME_ENTRY) + strlen(symNames[i].name) + 1;
+            n++;
+        }
+    }
+
+    if (n > 0)
+    {
+        pCopy = (SYM_NAME_ENTRY *) malloc(size);
+        if (pCopy == NULL)
+        {
+            n = -1;
+        }
+    }
+    if (pCopy != NULL)
+    {
+        pName = (char *) &pCopy[n];
+        n     = 0;
+        for (i = first; i < symNameCnt && strncmp(symNames[i].name, prefix, prefixLen) == 0; i++)
+        {
+            if (type < 0 || (symNames[i].type & ~N_EXT) == type)
+            {
+                pCopy[n]      = symNames[i];
+                pCopy[n].name = pName;
+                strcpy(pName, symNames[i].name);
+                pName += strlen(pName) + 1;
+                n++;
+            }
+        }
+    }
+
+    semGive(symNameSem);
+    *pCount = n;
+    return pCopy;
+}
+
+/**
+ * Iterator of vxSymbols, upvalue 1 is the table of the matches as name, 
+ * address, type triples, upvalue 2 the index of the next one.
+ */
+LOCAL int l_vxSymbolsNext(lua_State* luaVM)
+{
+    int i = (int) lua_tonumber(luaVM, lua_upvalueindex(2));
+
+    lua_rawgeti(luaVM, lua_upvalueindex(1), 3 * i + 1);
+    if (lua_isnil(luaVM, -1))
+    {
+        return 0;
+    }
+    lua_rawgeti(luaVM, lua_upvalueindex(1), 3 * i + 2);
+    lua_rawgeti(luaVM, lua_upvalueindex(1), 3 * i + 3);
+    lua_pushnumber(luaVM, i + 1);
+    lua_replace(luaVM, lua_upvalueindex(2));
+    return 3;   /* Three values pushed onto the lua stack */	
+}
+
+/**
+ * Returns an iterator over the symbols starting with prefix, optionally of
+ * one type. It returns the name, the address (lightuserdata) and the 
+ * type of each symbol, sorted by name.
+ * for name, addr, type in vxSymbols("drvX_" [, "text"]) do ... end
+ */
+int l_vxSymbols(lua_State* luaVM)
+{
+    static const char * const typeNames[] = { "abs", "text", "data", "bss", NULL };
+    static const int          typeValues[] = { N_ABS, N_TEXT, N_DATA, N_BSS };
+    const char *     prefix = luaL_checkstring(luaVM, 1);
+    SYM_NAME_ENTRY * pCopy;
+    int              type = -1;
+    int              skip = 0;
+    int              count;
+    int              i;
+
+    if (lua_type(luaVM, 2) == LUA_TNUMBER)
+    {
+        type = (int) lua_tonumber(luaVM, 2) & ~N_EXT;
+    }
+    else if (!lua_isnoneornil(luaVM, 2))
+    {
+        type = typeValues[luaL_checkoption(luaVM, 2, NULL, typeNames)];
+    }
+
+#ifdef LEADING_UNDERSCORE    
+    prefix = lua_pushfstring(luaVM, "_%s", prefix);
+    skip   = 1;
+#endif
+
+    pCopy = symNameCopy(prefix, type, &count);
+    if (count < 0)
+    {
+        return luaFail(luaVM, errnoGet(), "vxSymbols: out of memory");
+    }
+
+#if defined(LUA_5_2) || defined(LUA_5_1)
+    lua_createtable(luaVM, 3 * count, 0);
+#else
+    lua_newtable(luaVM);
+#endif
+    for (i = 0; i < count; i++)
+    {
+        lua_pushstring(luaVM, pCopy[i].name + skip);
+        lua_rawseti(luaVM, -2, 3 * i + 1);
+        lua_pushlightuserdata(luaVM, pCopy[i].value);
+        lua_rawseti(luaVM, -2, 3 * i + 2);
+        lua_pushnumber(luaVM, pCopy[i].type);
+        lua_rawseti(luaVM, -2, 3 * i + 3);
+    }
+    free(pCopy);
+
+    lua_pushnumber(luaVM, 0);
+    lua_pushcclosure(luaVM, l_vxSymbolsNext, 2);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/****************************************************************************** 
+ * Calls with a signature. 
+ *****************************************************************************/
+
+/* 
+   vxDoSig("name", "sig", ...) calls a function with typed arguments. The 
+   signature lists one character per argument, then '>' and the return type:
+     i  int, pointer or anything vxDo accepts
+     l  64 bit integer
+     d  double
+     f  float
+   Return types also include
+     u  unsigned int
+     w  register word, like i but a value wider than an int is returned as 
+        lightuserdata, this is what vxDo returns
+     p  pointer, as lightuserdata (nil for NULL)
+     s  char pointer, copied into a lua string (nil for NULL)
+     b  boolean
+     v  no return value
+   Example: result = vxDoSig("atan2", "dd>d", 1.5, 2.5)
+   The default return type is i, which can not hold a pointer on 64 bit 
+   targets, use p or w there for functions like malloc.
+
+   Floating point arguments are passed the way the ABI of the target passes 
+   them, without assembler: on ABIs with separate floating point argument 
+   registers the function is called as f(w0..w7, d0..d7) with the integer 
+   and floating point arguments sorted into the two register files, on stack
+   based and soft-float ABIs all arguments are packed into the argument words
+   as they would be laid out in memory.
+*/
+#define SIG_MAX_ARGS    15
+#define SIG_REG_WORDS   8       /* integer registers passed by SIG_CALL_REGS */
+#define SIG_REG_FPRS    8       /* fp registers passed by SIG_CALL_REGS */
+
+#if defined(__x86_64__)
+#define SIG_ABI_REGS
+#define SIG_GPR_MAX     6
+#define SIG_FPR_MAX     8
+#define SIG_FLOAT_BITS          /* floats go as single into the fp register */
+#elif defined(__aarch64__)
+#define SIG_ABI_REGS
+#define SIG_GPR_MAX     8
+#define SIG_FPR_MAX     8
+#define SIG_FLOAT_BITS
+#elif (defined(__PPC__) || defined(__powerpc__)) && !defined(_SOFT_FLOAT) && !defined(__NO_FPRS__)
+#define SIG_ABI_REGS
+#define SIG_GPR_MAX     8
+#define SIG_FPR_MAX     8
+#define SIG_PAIR_ALIGN          /* 64 bit integers in an aligned register pair */
+#elif defined(__ARM_PCS_VFP)
+#define SIG_ABI_REGS
+#define SIG_GPR_MAX     4
+#define SIG_FPR_MAX     8
+#define SIG_FLOAT_BITS
+#define SIG_FLOAT_BACKFILL      /* floats fill the single halves of d regs */
+#define SIG_PAIR_ALIGN
+#elif defined(__i386__)
+#define SIG_ABI_STACK
+#define SIG_FP_WORDS            /* fp arguments are passed in the words */
+#define SIG_FP_RET_REG          /* fp results are returned in a fp register */
+#else
+#define SIG_ABI_STACK
+#define SIG_PAIR_ALIGN
+#if defined(__SOFTFP__) || defined(__mips_soft_float) || defined(_SOFT_FLOAT) || defined(__NO_FPRS__)
+#define SIG_FP_WORDS
+#endif
+#endif
+
+#ifdef SIG_ABI_REGS
+#define SIG_FP_RET_REG
+#endif
+
+/* Compiled signature, cached per lua state */
+struct sigPlan {
+    int         nArgs;                  /* number of arguments */
+    int         nWords;                 /* number of argument words used */
+    char        retType;                /* return type character */
+    char        argType[SIG_MAX_ARGS];  /* argument type characters */
+    UINT8       argSlot[SIG_MAX_ARGS];  /* word or fp register slot */
+};
+
+/* Prototypes the functions are called through */
+#ifdef SIG_ABI_REGS
+#define SIG_PROTO \
+    (arg_word_t, arg_word_t, arg_word_t, arg_word_t, \
+     arg_word_t, arg_word_t, arg_word_t, arg_word_t, \
+     double, double, double, double, double, double, double, double)
+#define SIG_CALL_REGS(w, d) \
+    w[0], w[1], w[2], w[3], w[4], w[5], w[6], w[7], \
+    d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]
+typedef arg_word_t (*SIG_CALL_W) SIG_PROTO;
+typedef INT64      (*SIG_CALL_L) SIG_PROTO;
+typedef double     (*SIG_CALL_D) SIG_PROTO;
+#endif
+
+/* How a result comes back from the called function */
+#define SIG_RET_WORD    0       /* in an integer register */
+#define SIG_RET_INT64   1       /* in an integer register (pair) */
+#define SIG_RET_DOUBLE  2       /* in a fp register */
+
+/* Its address is the registry key of the compiled signature table */
+LOCAL char sigCacheKey;
+
+/**
+ * Checks a return type character. Returns an error message or NULL.
+ */
+LOCAL const char * sigCheckRetType(char retType)
+{
+    switch (retType)
+    {
+    case 'i':
+    case 'w':
+    case 'u':
+    case 'l':
+    case 'p':
+    case 's':
+    case 'b':
+    case 'v':
+        return NULL;
+    case 'd':
+    case 'f':
+#if !defined(SIG_FP_RET_REG) && !defined(SIG_FP_WORDS)
+        return "floating point results are not supported on this ABI";
+#endif
+        return NULL;
+    default:
+        return "unknown return type";
+    }
+}
+
+/**
+ * Returns how the result of the given return type comes back.
+ */
+LOCAL int sigRetClass(char retType)
+{
+    switch (retType)
+    {
+    case 'l':
+        return SIG_RET_INT64;
+#ifdef SIG_FP_RET_REG
+    case 'd':
+    case 'f':
+        return SIG_RET_DOUBLE;
+#else
+    case 'd':
+        return SIG_RET_INT64;   /* soft-float, float comes as a word */
+#endif
+    default:
+        return SIG_RET_WORD;
+    }
+}
+
+/**
+ * Pushes a result that came back in an integer register.
+ */
+LOCAL int sigPushWord(lua_State* luaVM, char retType, arg_word_t w)
+{
+    UINT32 fbits;
+    float  f;
+
+    switch (retType)
+    {
+    case 'v':
+        return 0;
+    case 'u':
+        lua_pushnumber(luaVM, (unsigned int) w);
+        break;
+    case 'p':
+        if (w != 0)
+            lua_pushlightuserdata(luaVM, (void *) w);
+        else
+            lua_pushnil(luaVM);
+        break;
+    case 's':
+        if (w != 0)
+            lua_pushstring(luaVM, (const char *) w);
+        else
+            lua_pushnil(luaVM);
+        break;
+    case 'b':
+        lua_pushboolean(luaVM, (int) w != 0);
+        break;
+    case 'f':
+        fbits = (UINT32) w;     /* soft-float */
+        memcpy(&f, &fbits, sizeof(f));
+        lua_pushnumber(luaVM, f);
+        break;
+    case 'w':
+        /* Int results may come back zero extended on 64 bit targets and
+           stay numbers, wider words are pointers or longs */
+        if ((w >> 16 >> 16) != 0 && (arg_word_t) (long) (int) w != w)
+        {
+            lua_pushlightuserdata(luaVM, (void *) w);
+            break;
+        }
+        lua_pushnumber(luaVM, (int) w);
+        break;
+    default:
+        lua_pushnumber(luaVM, (int) w);
+        break;
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Pushes a result that came back as 64 bit integer.
+ */
+LOCAL int sigPushInt64(lua_State* luaVM, char retType, INT64 l)
+{
+    double d;
+
+    if (retType == 'd')
+    {
+        memcpy(&d, &l, sizeof(d));  /* soft-float */
+        lua_pushnumber(luaVM, d);
+    }
+    else
+    {
+        lua_pushnumber(luaVM, (lua_Number) l);
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Pushes a result that came back in a fp register.
+ */
+LOCAL int sigPushDouble(lua_State* luaVM, char retType, double d)
+{
+#ifdef SIG_FLOAT_BITS
+    if (retType == 'f')
+    {
+        UINT64 bits;
+        UINT32 fbits;
+        float  f;
+
+        memcpy(&bits, &d, sizeof(d));
+        fbits = (UINT32) bits;  /* the single is the low half */
+        memcpy(&f, &fbits, sizeof(f));
+        d = f;
+    }
+#endif
+    lua_pushnumber(luaVM, d);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/* Parameter and argument lists of n argument words */
+#define ARG_P0  void
+#define ARG_P1  arg_word_t
+#define ARG_P2  ARG_P1, arg_word_t
+#define ARG_P3  ARG_P2, arg_word_t
+#define ARG_P4  ARG_P3, arg_word_t
+#define ARG_P5  ARG_P4, arg_word_t
+#define ARG_P6  ARG_P5, arg_word_t
+#define ARG_P7  ARG_P6, arg_word_t
+#define ARG_P8  ARG_P7, arg_word_t
+#define ARG_P9  ARG_P8, arg_word_t
+#define ARG_P10 ARG_P9, arg_word_t
+#define ARG_P11 ARG_P10, arg_word_t
+#define ARG_P12 ARG_P11, arg_word_t
+#define ARG_P13 ARG_P12, arg_word_t
+#define ARG_P14 ARG_P13, arg_word_t
+#define ARG_P15 ARG_P14, arg_word_t
+#define ARG_P16 ARG_P15, arg_word_t
+#define ARG_P17 ARG_P16, arg_word_t
+#define ARG_P18 ARG_P17, arg_word_t
+#define ARG_P19 ARG_P18, arg_word_t
+#define ARG_P20 ARG_P19, arg_word_t
+#define ARG_P21 ARG_P20, arg_word_t
+#define ARG_P22 ARG_P21, arg_word_t
+#define ARG_P23 ARG_P22, arg_word_t
+#define ARG_P24 ARG_P23, arg_word_t
+#define ARG_P25 ARG_P24, arg_word_t
+#define ARG_P26 ARG_P25, arg_word_t
+#define ARG_P27 ARG_P26, arg_word_t
+#define ARG_P28 ARG_P27, arg_word_t
+#define ARG_P29 ARG_P28, arg_word_t
+#define ARG_P30 ARG_P29, arg_word_t
+#define ARG_P31 ARG_P30, arg_word_t
+#define ARG_P32 ARG_P31, arg_word_t
+
+#define ARG_A0
+#define ARG_A1  w[0]
+#define ARG_A2  ARG_A1, w[1]
+#define ARG_A3  ARG_A2, w[2]
+#define ARG_A4  ARG_A3, w[3]
+#define ARG_A5  ARG_A4, w[4]
+#define ARG_A6  ARG_A5, w[5]
+#define ARG_A7  ARG_A6, w[6]
+#define ARG_A8  ARG_A7, w[7]
+#define ARG_A9  ARG_A8, w[8]
+#define ARG_A10 ARG_A9, w[9]
+#define ARG_A11 ARG_A10, w[10]
+#define ARG_A12 ARG_A11, w[11]
+#define ARG_A13 ARG_A12, w[12]
+#define ARG_A14 ARG_A13, w[13]
+#define ARG_A15 ARG_A14, w[14]
+#define ARG_A16 ARG_A15, w[15]
+#define ARG_A17 ARG_A16, w[16]
+#define ARG_A18 ARG_A17, w[17]
+#define ARG_A19 ARG_A18, w[18]
+#define ARG_A20 ARG_A19, w[19]
+#define ARG_A21 ARG_A20, w[20]
+#define ARG_A22 ARG_A21, w[21]
+#define ARG_A23 ARG_A22, w[22]
+#define ARG_A24 ARG_A23, w[23]
+#define ARG_A25 ARG_A24, w[24]
+#define ARG_A26 ARG_A25, w[25]
+#define ARG_A27 ARG_A26, w[26]
+#define ARG_A28 ARG_A27, w[27]
+#define ARG_A29 ARG_A28, w[28]
+#define ARG_A30 ARG_A29, w[29]
+#define ARG_A31 ARG_A30, w[30]
+#define ARG_A32 ARG_A31, w[31]
+
+/* Calls fn with n argument words, one call per way the result comes back */
+#define ARG_TRAMPOLINE(n) \
+LOCAL int argCall##n(lua_State* luaVM, FUNCPTR fn, arg_word_t * w, char retType) \
+{ \
+    switch (sigRetClass(retType)) \
+    { \
+    case SIG_RET_INT64: \
+        return sigPushInt64(luaVM, retType, ((INT64 (*)(ARG_P##n)) fn)(ARG_A##n)); \
+    case SIG_RET_DOUBLE: \
+        return sigPushDouble(luaVM, retType, ((double (*)(ARG_P##n)) fn)(ARG_A##n)); \
+    default: \
+        return sigPushWord(luaVM, retType, ((arg_word_t (*)(ARG_P##n)) fn)(ARG_A##n)); \
+    } \
+}
+
+ARG_TRAMPOLINE(0)
+ARG_TRAMPOLINE(1)
+ARG_TRAMPOLINE(2)
+ARG_TRAMPOLINE(3)
+ARG_TRAMPOLINE(4)
+ARG_TRAMPOLINE(5)
+ARG_TRAMPOLINE(6)
+ARG_TRAMPOLINE(7)
+ARG_TRAMPOLINE(8)
+ARG_TRAMPOLINE(9)
+ARG_TRAMPOLINE(10)
+ARG_TRAMPOLINE(11)
+ARG_TRAMPOLINE(12)
+ARG_TRAMPOLINE(13)
+ARG_TRAMPOLINE(14)
+ARG_TRAMPOLINE(15)
+ARG_TRAMPOLINE(16)
+ARG_TRAMPOLINE(17)
+ARG_TRAMPOLINE(18)
+ARG_TRAMPOLINE(19)
+ARG_TRAMPOLINE(20)
+ARG_TRAMPOLINE(21)
+ARG_TRAMPOLINE(22)
+ARG_TRAMPOLINE(23)
+ARG_TRAMPOLINE(24)
+ARG_TRAMPOLINE(25)
+ARG_TRAMPOLINE(26)
+ARG_TRAMPOLINE(27)
+ARG_TRAMPOLINE(28)
+ARG_TRAMPOLINE(29)
+ARG_TRAMPOLINE(30)
+ARG_TRAMPOLINE(31)
+ARG_TRAMPOLINE(32)
+
+typedef int (*ARG_TRAMPOLINE_FUNC)(lua_State* luaVM, FUNCPTR fn, arg_word_t * w, char retType);
+
+/* Trampolines by number of argument words */
+LOCAL const ARG_TRAMPOLINE_FUNC argTrampolines[ARG_MAX_WORDS + 1] = {
+    argCall0, argCall1, argCall2, argCall3, argCall4, argCall5, argCall6, argCall7,
+    argCall8, argCall9, argCall10, argCall11, argCall12, argCall13, argCall14, argCall15,
+    argCall16, argCall17, argCall18, argCall19, argCall20, argCall21, argCall22, argCall23,
+    argCall24, argCall25, argCall26, argCall27, argCall28, argCall29, argCall30, argCall31,
+    argCall32
+};
+
+/**
+ * Calls a function with nWords argument words and pushes the result.
+ */
+LOCAL int sigInvokeWords(lua_State* luaVM, FUNCPTR fn, arg_word_t * w, int nWords, char retType)
+{
+    return (*argTrampolines[nWords])(luaVM, fn, w, retType);
+}
+
+#ifdef SIG_ABI_REGS
+/**
+ * Calls a function with integer and fp register arguments and pushes the 
+ * result.
+ */
+LOCAL int sigInvokeRegs(lua_State* luaVM, FUNCPTR fn, arg_word_t * w, double * d, char retType)
+{
+    switch (sigRetClass(retType))
+    {
+    case SIG_RET_INT64:
+        return sigPushInt64(luaVM, retType, ((SIG_CALL_L) fn)(SIG_CALL_REGS(w, d)));
+    case SIG_RET_DOUBLE:
+        return sigPushDouble(luaVM, retType, ((SIG_CALL_D) fn)(SIG_CALL_REGS(w, d)));
+    default:
+        return sigPushWord(luaVM, retType, ((SIG_CALL_W) fn)(SIG_CALL_REGS(w, d)));
+    }
+}
+#endif
+
+/**
+ * Compiles a signature into a plan. Returns an error message or NULL.
+ */
+LOCAL const char * sigCompile(const char * sig, SIG_PLAN * pPlan)
+{
+    int          words = 0;     /* integer words / registers in use */
+    const char * p;
+#ifdef SIG_ABI_REGS
+    int          fprs = 0;      /* fp registers (singles with backfill) */
+#ifdef SIG_FLOAT_BACKFILL
+    UINT32       singles = 0;   /* bit mask of used single registers */
+    int          s;
+#endif
+#endif
+
+    memset(pPlan, 0, sizeof(SIG_PLAN));
+
+    for (p = sig; *p != '\0' && *p != '>'; p++)
+    {
+        int n = pPlan->nArgs;
+
+        if (n == SIG_MAX_ARGS)
+            return "too many arguments";
+        pPlan->argType[n] = *p;
+
+        switch (*p)
+        {
+        case 'i':
+            pPlan->argSlot[n] = words++;
+            break;
+        case 'l':
+            if (sizeof(arg_word_t) < 8)
+            {
+#ifdef SIG_PAIR_ALIGN
+                words = (words + 1) & ~1;
+#endif
+                pPlan->argSlot[n] = words;
+                words += 2;
+            }
+            else
+            {
+                pPlan->argSlot[n] = words++;
+            }
+            break;
+        case 'd':
+        case 'f':
+#if defined(SIG_ABI_REGS) && defined(SIG_FLOAT_BACKFILL)
+            /* lowest free single, or lowest free aligned pair for doubles */
+            for (s = 0; s < 2 * SIG_FPR_MAX; s += (*p == 'd') ? 2 : 1)
+            {
+                UINT32 mask = ((*p == 'd') ? 3 : 1) << s;
+
+                if ((singles & mask) == 0)
+                {
+                    singles |= mask;
+                    break;
+                }
+            }
+            if (s >= 2 * SIG_FPR_MAX)
+                return "too many floating point arguments for this ABI";
+            pPlan->argSlot[n] = s;
+#elif defined(SIG_ABI_REGS)
+            if (fprs == SIG_FPR_MAX)
+                return "too many floating point arguments for this ABI";
+            pPlan->argSlot[n] = fprs++;
+#elif defined(SIG_FP_WORDS)
+            if (*p == 'f' || sizeof(arg_word_t) >= 8)
+            {
+                pPlan->argSlot[n] = words++;
+            }
+            else
+            {
+#ifdef SIG_PAIR_ALIGN
+                words = (words + 1) & ~1;
+#endif
+                pPlan->argSlot[n] = words;
+                words += 2;
+            }
+#else
+            return "floating point arguments are not supported on this ABI";
+#endif
+            break;
+        default:
+            return "unknown argument type";
+        }
+        pPlan->nArgs++;
+    }
+
+#ifdef SIG_ABI_REGS
+    if (words > SIG_GPR_MAX)
+        return "too many integer arguments for this ABI";
+    (void) fprs;
+#else
+    if (words > SIG_MAX_ARGS)
+        return "too many arguments";
+#endif
+    pPlan->nWords = words;
+
+    pPlan->retType = (*p == '>') ? p[1] : 'i';
+    return sigCheckRetType(pPlan->retType);
+}
+
+/**
+ * Pushes the compiled plan of the signature at stack index sigIdx, from the
+ * cache of the lua state, and returns it. Raises a lua error for invalid 
+ * signatures.
+ */
+LOCAL SIG_PLAN * sigCacheGetPlan(lua_State* luaVM, int sigIdx)
+{
+    SIG_PLAN *   pPlan;
+    const char * err;
+
+    luaL_checkstring(luaVM, sigIdx);
+    lua_pushlightuserdata(luaVM, &sigCacheKey);
+    lua_rawget(luaVM, LUA_REGISTRYINDEX);
+    if (!lua_istable(luaVM, -1))
+    {
+        lua_pop(luaVM, 1);
+        lua_newtable(luaVM);
+        lua_pushlightuserdata(luaVM, &sigCacheKey);
+        lua_pushvalue(luaVM, -2);
+        lua_rawset(luaVM, LUA_REGISTRYINDEX);
+    }
+
+    lua_pushvalue(luaVM, sigIdx);
+    lua_rawget(luaVM, -2);
+    pPlan = (SIG_PLAN *) lua_touserdata(luaVM, -1);
+
+    if (pPlan == NULL)
+    {
+        lua_pop(luaVM, 1);
+        lua_pushvalue(luaVM, sigIdx);
+        pPlan = (SIG_PLAN *) lua_newuserdata(luaVM, sizeof(SIG_PLAN));
+        err = sigCompile(lua_tostring(luaVM, sigIdx), pPlan);
+        if (err != NULL)
+        {
+            luaL_error(luaVM, "vxDoSig: %s in signature \"%s\"", err, 
+                       lua_tostring(luaVM, sigIdx));
+        }
+        lua_pushvalue(luaVM, -1);
+        lua_insert(luaVM, -3);
+        lua_rawset(luaVM, -4);
+    }
+
+    lua_replace(luaVM, -2);
+    return pPlan;
+}
+
+/**
+ * Calls a function according to a compiled signature with the lua arguments
+ * from index firstArg on and pushes the result.
+ */
+LOCAL int sigCall(lua_State* luaVM, FUNCPTR function_address, SIG_PLAN * pPlan, int firstArg)
+{
+    arg_word_t words[SIG_MAX_ARGS];
+    int        i;
+    INT64      l;
+    double     d;
+    float      f;
+    UINT32     fbits;
+    int        nResults;
+    LUA_CALL_SCOPE scope = LUA_CALL_SCOPE_INIT;
+#ifdef SIG_ABI_REGS
+    UINT64     fprs[SIG_REG_FPRS];
+    double     fprArgs[SIG_REG_FPRS];
+#endif
+
+    memset(words, 0, sizeof(words));
+#ifdef SIG_ABI_REGS
+    memset(fprs, 0, sizeof(fprs));
+#endif
+
+    for (i = 0; i < pPlan->nArgs; i++)
+    {
+        int idx  = firstArg + i;
+        int slot = pPlan->argSlot[i];
+
+        switch (pPlan->argType[i])
+        {
+        case 'i':
+            words[slot] = luaArgToWord(luaVM, idx, &scope);
+            break;
+        case 'l':
+            l = (INT64) lua_tonumber(luaVM, idx);
+            if (sizeof(arg_word_t) < 8)
+                memcpy(&words[slot], &l, sizeof(l));    /* memory order */
+            else
+                words[slot] = (arg_word_t) l;
+            break;
+        case 'd':
+            d = (double) lua_tonumber(luaVM, idx);
+#ifdef SIG_ABI_REGS
+#ifdef SIG_FLOAT_BACKFILL
+            slot /= 2;
+#endif
+            memcpy(&fprs[slot], &d, sizeof(d));
+#else
+            memcpy(&words[slot], &d, sizeof(d));
+#endif
+            break;
+        case 'f':
+            f = (float) lua_tonumber(luaVM, idx);
+            memcpy(&fbits, &f, sizeof(f));
+#if defined(SIG_ABI_REGS) && defined(SIG_FLOAT_BACKFILL)
+            fprs[slot / 2] |= (UINT64) fbits << ((slot & 1) ? 32 : 0);
+#elif defined(SIG_ABI_REGS) && defined(SIG_FLOAT_BITS)
+            fprs[slot] = fbits;
+#elif defined(SIG_ABI_REGS)
+            d = f;      /* fp registers always hold doubles */
+            memcpy(&fprs[slot], &d, sizeof(d));
+#else
+            words[slot] = fbits;
+#endif
+            break;
+        }
+    }
+
+#ifdef SIG_ABI_REGS
+    memcpy(fprArgs, fprs, sizeof(fprArgs));
+    nResults = sigInvokeRegs(luaVM, function_address, words, fprArgs, pPlan->retType);
+#else
+    nResults = sigInvokeWords(luaVM, function_address, words, pPlan->nWords, pPlan->retType);
+#endif
+    luaCallScopeEnd(luaVM, &scope);
+    return nResults;
+}
+
+/**
+ * Executes a function with a signature called from lua.
+ * result = vxDoSig("my_c_function", "dd>d", 1.5, 2.5)
+ */
+int l_vxDoSig(lua_State* luaVM)
+{
+    SYM_CACHE_ENTRY * pEntry;
+    SIG_PLAN *        pPlan;
+    UINT32            t0;
+    int               nResults;
+
+    pPlan = sigCacheGetPlan(luaVM, 2);
+    lua_pop(luaVM, 1);      /* the cache table keeps the plan alive */
+
+    pEntry = symCacheFindFunction( luaVM, 1 );
+    if ( NULL == pEntry )
+    {
+        return luaSymFail(luaVM, 1, "Function");
+    }
+
+    t0 = LUA_STATS_NOW();
+    nResults = sigCall(luaVM, (FUNCPTR) pEntry->value, pPlan, 3);
+    LUA_STATS_CALL(pEntry, t0);
+    return nResults;
+}
+
+/**
+ * Returns the up to date cache entry of the function returned by vxBind at
+ * stack index idx and its signature in *ppPlan (NULL without signature).
+ * Returns NULL if it is no such function or does not exist anymore.
+ */
+LOCAL SYM_CACHE_ENTRY * luaBatchBound(lua_State* luaVM, int idx, SIG_PLAN ** ppPlan)
+{
+    lua_CFunction     f = lua_tocfunction(luaVM, idx);
+    SYM_CACHE_ENTRY * pEntry;
+
+    if (f != l_vxBoundCall && f != l_vxBoundSigCall)
+    {
+        return NULL;
+    }
+
+    lua_getupvalue(luaVM, idx, 1);
+    pEntry = (SYM_CACHE_ENTRY *) lua_touserdata(luaVM, -1);
+    lua_pop(luaVM, 1);
+    if (f == l_vxBoundSigCall)
+    {
+        lua_getupvalue(luaVM, idx, 3);
+        *ppPlan = (SIG_PLAN *) lua_touserdata(luaVM, -1);
+        lua_pop(luaVM, 1);  /* the function keeps the plan alive */
+    }
+
+    if (pEntry->gen != symCacheGen)
+    {
+        /* Symbol table changed since binding, this refreshes the entry */
+        lua_getupvalue(luaVM, idx, 2);
+        pEntry = symCacheFindFunction(luaVM, lua_gettop(luaVM));
+        lua_pop(luaVM, 1);
+    }
+    return pEntry;
+}
+
+/**
+ * Executes a list of calls, each a table of a function name or a function
+ * returned by vxBind followed by the arguments. Stores the first result of
+ * every call, true for void functions, in results or a new table and 
+ * returns it. Stops at the first function that does not exist.
+ * results = vxBatch({ {"fnA", 1, 2}, {fnB, "x"} } [, results])
+ */
+int l_vxBatch(lua_State* luaVM)
+{
+    SYM_CACHE_ENTRY * pEntry;
+    SIG_PLAN *        pPlan;
+    UINT32            t0;
+    int               nCalls;
+    int               nArgs;
+    int               nResults;
+    int               i;
+    int               j;
+
+    luaL_checktype(luaVM, 1, LUA_TTABLE);
+    nCalls = luaTableLen(luaVM, 1);
+    lua_settop(luaVM, 2);
+    if (!lua_istable(luaVM, 2))
+    {
+        lua_pop(luaVM, 1);
+#if defined(LUA_5_2) || defined(LUA_5_1)
+        lua_createtable(luaVM, nCalls, 0);
+#else
+        lua_newtable(luaVM);
+#endif
+    }
+
+    for (i = 1; i <= nCalls; i++)
+    {
+        /* Stack: calls, results, call, function, arguments */
+        lua_rawgeti(luaVM, 1, i);
+        if (!lua_istable(luaVM, 3))
+        {
+            return luaL_error(luaVM, "vxBatch: call %d is not a table", i);
+        }
+        nArgs = luaTableLen(luaVM, 3) - 1;
+        luaL_checkstack(luaVM, nArgs + 4, "vxBatch: too many arguments");
+
+        lua_rawgeti(luaVM, 3, 1);
+        pPlan = NULL;
+        if (lua_type(luaVM, 4) == LUA_TSTRING)
+        {
+            pEntry = symCacheFindFunction(luaVM, 4);
+        }
+        else if (lua_type(luaVM, 4) == LUA_TFUNCTION)
+        {
+            pEntry = luaBatchBound(luaVM, 4, &pPlan);
+        }
+        else
+        {
+            return luaL_error(luaVM, "vxBatch: call %d: function name expected", i);
+        }
+        if (pEntry == NULL)
+        {
+            return luaFail(luaVM, errnoGet(), "vxBatch: call %d: function %s does not exist", 
+                           i, lua_isstring(luaVM, 4) ? lua_tostring(luaVM, 4) : "?");
+        }
+
+        for (j = 2; j <= nArgs + 1; j++)
+        {
+            lua_rawgeti(luaVM, 3, j);
+        }
+
+        t0 = LUA_STATS_NOW();
+        if (pPlan != NULL)
+            nResults = sigCall(luaVM, (FUNCPTR) pEntry->value, pPlan, 5);
+        else
+            nResults = luaCallFunction(luaVM, (FUNCPTR) pEntry->value, 5, 'w');
+        LUA_STATS_CALL(pEntry, t0);
+
+        if (nResults > 0)
+            lua_pushvalue(luaVM, -nResults);
+        else
+            lua_pushboolean(luaVM, 1);
+        lua_rawseti(luaVM, 2, i);
+        lua_settop(luaVM, 2);
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/****************************************************************************** 
+ * Typed memory access. 
+   A type name selects how a value in memory is read and written:
+     i8 u8 i16 u16 i32 u32 i64 u64 float double
+   Plain addresses (u32) are the default, as in versions before 1.5.
+   64 bit values are converted to lua numbers and lose precision above 2^53.
+ *****************************************************************************/
+
+/* Memory types */
+#define MEM_I8      0
+#define MEM_U8      1
+#define MEM_I16     2
+#define MEM_U16     3
+#define MEM_I32     4
+#define MEM_U32     5
+#define MEM_I64     6
+#define MEM_U64     7
+#define MEM_FLOAT   8
+#define MEM_DOUBLE  9
+
+LOCAL const char * memTypeNames[] = {
+    "i8", "u8", "i16", "u16", "i32", "u32", "i64", "u64", "float", "double", NULL
+};
+
+LOCAL const size_t memTypeSizes[] = {
+    1, 1, 2, 2, 4, 4, 8, 8, sizeof(float), sizeof(double)
+};
+
+/* Alignment of the memory types as struct members, which is less than the 
+   size for some ABIs, e.g. 4 for doubles and 64 bit integers on i386 */
+typedef struct { char c; INT16  t; } MEM_ALIGN_16;
+typedef struct { char c; INT32  t; } MEM_ALIGN_32;
+typedef struct { char c; INT64  t; } MEM_ALIGN_64;
+typedef struct { char c; float  t; } MEM_ALIGN_FLOAT;
+typedef struct { char c; double t; } MEM_ALIGN_DOUBLE;
+
+LOCAL const size_t memTypeAligns[] = {
+    1, 1, 
+    offsetof(MEM_ALIGN_16, t),    offsetof(MEM_ALIGN_16, t), 
+    offsetof(MEM_ALIGN_32, t),    offsetof(MEM_ALIGN_32, t), 
+    offsetof(MEM_ALIGN_64, t),    offsetof(MEM_ALIGN_64, t), 
+    offsetof(MEM_ALIGN_FLOAT, t), offsetof(MEM_ALIGN_DOUBLE, t)
+};
+
+/**
+ * Returns the memory type of a type name, or -1 if it is unknown.
+ */
+LOCAL int memFindType(const char * name)
+{
+    int type;
+
+    for (type = 0; memTypeNames[type] != NULL; type++)
+    {
+        if (strcmp(name, memTypeNames[type]) == 0)
+        {
+            return type;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the memory type of the type name at stack index idx, MEM_U32 when
+ * there is none. Raises a lua error for unknown type names.
+ */
+LOCAL int memCheckType(lua_State* luaVM, int idx)
+{
+    int type;
+
+    if (lua_isnoneornil(luaVM, idx))
+    {
+        return MEM_U32;
+    }
+
+    type = memFindType(luaL_checkstring(luaVM, idx));
+    if (type < 0)
+    {
+        return luaL_argerror(luaVM, idx, "unknown memory type");
+    }
+    return type;
+}
+
+/**
+ * Pushes the value of the given memory type at address addr.
+ */
+LOCAL void memPeek(lua_State* luaVM, const void * addr, int type)
+{
+    lua_Number n;
+
+    switch (type)
+    {
+    case MEM_I8:     n = *(const INT8 *)   addr; break;
+    case MEM_U8:     n = *(const UINT8 *)  addr; break;
+    case MEM_I16:    n = *(const INT16 *)  addr; break;
+    case MEM_U16:    n = *(const UINT16 *) addr; break;
+    case MEM_I32:    n = *(const INT32 *)  addr; break;
+    case MEM_I64:    n = (lua_Number) *(const INT64 *)  addr; break;
+    case MEM_U64:    n = (lua_Number) *(const UINT64 *) addr; break;
+    case MEM_FLOAT:  n = *(const float *)  addr; break;
+    case MEM_DOUBLE: n = *(const double *) addr; break;
+    default:         n = *(const UINT32 *) addr; break;
+    }
+    lua_pushnumber(luaVM, n);
+}
+
+/**
+ * Writes the number at stack index idx as the given memory type to address 
+ * addr. Integers are truncated to the width of the type.
+ */
+LOCAL void memPoke(lua_State* luaVM, void * addr, int type, int idx)
+{
+    lua_Number n = luaL_checknumber(luaVM, idx);
+    UINT64     u;
+
+    if (type == MEM_FLOAT)
+    {
+        *(float *) addr = (float) n;
+        return;
+    }
+    if (type == MEM_DOUBLE)
+    {
+        *(double *) addr = n;
+        return;
+    }
+
+    /* Negative numbers wrap like a C cast of a signed value */
+    u = (n < 0) ? (UINT64) (INT64) n : (UINT64) n;
+    switch (type)
+    {
+    case MEM_I8:
+    case MEM_U8:     *(UINT8 *)  addr = (UINT8)  u; break;
+    case MEM_I16:
+    case MEM_U16:    *(UINT16 *) addr = (UINT16) u; break;
+    case MEM_I64:
+    case MEM_U64:    *(UINT64 *) addr = u;          break;
+    default:         *(UINT32 *) addr = (UINT32) u; break;
+    }
+}
+
+/**
+ * Gets the value of a global variable.
+ * value = vxGet("varname" [, "type"])
+ */
+int l_vxGet(lua_State* luaVM)
+{
+    char * addr;
+    int    type = memCheckType(luaVM, 2);
+
+#ifdef VERBOSE       
+    printf("Variable name : %s\n", lua_tostring(luaVM, 1));
+#endif
+
+    addr = symCacheFindVariable(luaVM, 1);
+    if (addr == NULL)
+    {
+        return luaSymFail(luaVM, 1, "Variable");
+    }
+
+    memPeek(luaVM, addr, type);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+
+/**
+ * Sets the value of a global variable.
+ * vxSet("varname", value [, "type"])
+ */
+int l_vxSet(lua_State* luaVM)
+{
+    char * addr;
+    int    type = memCheckType(luaVM, 3);
+
+#ifdef VERBOSE       
+    printf("Variable name : %s\n", lua_tostring(luaVM, 1));
+#endif
+
+    if (lua_gettop(luaVM) < 2)
+    {
+        return luaL_argerror(luaVM, 2, "value expected");
+    }
+
+    addr = symCacheFindVariable(luaVM, 1);
+    if (addr == NULL)
+    {
+        return luaSymFail(luaVM, 1, "Variable");
+    }
+
+    memPoke(luaVM, addr, type, 2);
+    return 0;
+}
+
+/* Metatable name of vxVar bindings */
+#define VAR_BINDING_META    "vxLuaGlue.var"
+
+/* Global variable binding, the userdata returned by vxVar */
+typedef struct {
+    char *  addr;       /* address of the variable */
+    int     gen;        /* symCacheGen at the time of resolution */
+    int     type;       /* memory type */
+    char    name[1];    /* symbol name, allocated with the binding */
+} VAR_BINDING;
+
+/**
+ * Returns the address of a bound variable, resolving it again when the 
+ * symbol table changed since binding.
+ */
+LOCAL char * varBindingAddr(lua_State* luaVM, VAR_BINDING * pVar)
+{
+    char *   symbol_value;
+    SYM_TYPE symbol_type;
+    BOOL     partial;
+
+    if (pVar->gen != symCacheGen)
+    {
+        if (OK != symLookupVariable(luaVM, pVar->name, &symbol_value, &symbol_type, &partial))
+        {
+            luaL_error(luaVM, "vxVar: %s does not exist anymore", pVar->name);
+        }
+        pVar->addr = symbol_value;
+        pVar->gen  = symCacheGen;
+    }
+    return pVar->addr;
+}
+
+/**
+ * __index of vxVar bindings, var.value reads the variable.
+ */
+LOCAL int l_vxVarIndex(lua_State* luaVM)
+{
+    VAR_BINDING * pVar = (VAR_BINDING *) luaL_checkudata(luaVM, 1, VAR_BINDING_META);
+    const char *  key  = luaL_checkstring(luaVM, 2);
+
+    if (strcmp(key, "value") == 0)
+    {
+        memPeek(luaVM, varBindingAddr(luaVM, pVar), pVar->type);
+    }
+    else if (strcmp(key, "addr") == 0)
+    {
+        lua_pushlightuserdata(luaVM, varBindingAddr(luaVM, pVar));
+    }
+    else if (strcmp(key, "type") == 0)
+    {
+        lua_pushstring(luaVM, memTypeNames[pVar->type]);
+    }
+    else
+    {
+        lua_pushnil(luaVM);
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * __newindex of vxVar bindings, var.value = x writes the variable.
+ */
+LOCAL int l_vxVarNewIndex(lua_State* luaVM)
+{
+    VAR_BINDING * pVar = (VAR_BINDING *) luaL_checkudata(luaVM, 1, VAR_BINDING_META);
+    const char *  key  = luaL_checkstring(luaVM, 2);
+
+    if (strcmp(key, "value") != 0)
+    {
+        return luaL_error(luaVM, "vxVar: %s is read only", key);
+    }
+    memPoke(luaVM, varBindingAddr(luaVM, pVar), pVar->type, 3);
+    return 0;
+}
+
+/**
+ * Creates the metatable of vxVar bindings in a lua state.
+ */
+LOCAL void varBindingCreate(lua_State* luaVM)
+{
+    luaL_newmetatable(luaVM, VAR_BINDING_META);
+    lua_pushstring(luaVM, "__index");
+    lua_pushcfunction(luaVM, l_vxVarIndex);
+    lua_rawset(luaVM, -3);
+    lua_pushstring(luaVM, "__newindex");
+    lua_pushcfunction(luaVM, l_vxVarNewIndex);
+    lua_rawset(luaVM, -3);
+    lua_pop(luaVM, 1);
+}
+
+/**
+ * Resolves a global variable once and returns a binding to it.
+ * counter = vxVar("varname" [, "type"])
+ * counter.value = counter.value + 1
+ */
+int l_vxVar(lua_State* luaVM)
+{
+    VAR_BINDING * pVar;
+    char *        addr;
+    size_t        len;
+    int           type = memCheckType(luaVM, 2);
+
+    addr = symCacheFindVariable(luaVM, 1);
+    if (addr == NULL)
+    {
+        return luaSymFail(luaVM, 1, "Variable");
+    }
+
+    lua_tolstring(luaVM, 1, &len);
+    pVar = (VAR_BINDING *) lua_newuserdata(luaVM, sizeof(VAR_BINDING) + len);
+    pVar->addr = addr;
+    pVar->gen  = symCacheGen;
+    pVar->type = type;
+    memcpy(pVar->name, lua_tostring(luaVM, 1), len + 1);
+
+    luaL_getmetatable(luaVM, VAR_BINDING_META);
+    lua_setmetatable(luaVM, -2);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+
+/* Limit of memCheckAddrEx for addresses that are no vxBuffer */
+#define MEM_NO_LIMIT    ((size_t) -1)
+
+/**
+ * Returns the address at stack index idx, a number, a lightuserdata or a
+ * vxBuffer, and in *pLimit (if not NULL) the size of a vxBuffer or 
+ * MEM_NO_LIMIT.
+ * Raises a lua error for other values and for NULL.
+ */
+LOCAL char * memCheckAddrEx(lua_State* luaVM, int idx, size_t * pLimit)
+{
+    lua_Number n;
+    char *     addr = NULL;
+    size_t     limit = MEM_NO_LIMIT;
+
+    if (lua_islightuserdata(luaVM, idx))
+    {
+        addr = (char *) lua_touserdata(luaVM, idx);
+    }
+    else if (lua_isuserdata(luaVM, idx))
+    {
+        addr = luaBufferData(luaVM, idx, &limit);
+    }
+    else if (lua_type(luaVM, idx) == LUA_TNUMBER)
+    {
+        /* Addresses returned as int by vxDo are negative above 2GB */
+        n = lua_tonumber(luaVM, idx);
+        addr = (char *) ((n < 0) ? (arg_word_t) (INT64) n : (arg_word_t) (UINT64) n);
+    }
+    else
+    {
+        luaL_argerror(luaVM, idx, "address expected");
+    }
+
+    if (addr == NULL)
+    {
+        luaL_argerror(luaVM, idx, "NULL address");
+    }
+    if (pLimit != NULL)
+    {
+        *pLimit = limit;
+    }
+    return addr;
+}
+
+/**
+ * Returns the address at stack index idx, see memCheckAddrEx.
+ */
+LOCAL char * memCheckAddr(lua_State* luaVM, int idx)
+{
+    return memCheckAddrEx(luaVM, idx, NULL);
+}
+
+/**
+ * Raises a lua error when an access of len bytes exceeds limit, the size 
+ * of the vxBuffer at stack index idx.
+ */
+LOCAL void memCheckLen(lua_State* luaVM, int idx, size_t limit, lua_Number len)
+{
+    if (limit != MEM_NO_LIMIT && len > (lua_Number) limit)
+    {
+        luaL_argerror(luaVM, idx, "access beyond the end of the buffer");
+    }
+}
+
+/**
+ * Reads a block of memory into a lua string.
+ * data = vxRead(addr, len)
+ */
+int l_vxRead(lua_State* luaVM)
+{
+    size_t     limit;
+    char *     addr = memCheckAddrEx(luaVM, 1, &limit);
+    lua_Number len  = luaL_checknumber(luaVM, 2);
+
+    luaL_argcheck(luaVM, len >= 0, 2, "negative length");
+    memCheckLen(luaVM, 1, limit, len);
+    lua_pushlstring(luaVM, addr, (size_t) len);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Writes a lua string to memory.
+ * vxWrite(addr, data)
+ */
+int l_vxWrite(lua_State* luaVM)
+{
+    size_t       limit;
+    char *       addr = memCheckAddrEx(luaVM, 1, &limit);
+    size_t       len;
+    const char * data = luaL_checklstring(luaVM, 2, &len);
+
+    memCheckLen(luaVM, 1, limit, (lua_Number) len);
+    memcpy(addr, data, len);
+    return 0;
+}
+
+/**
+ * Reads an array of the given memory type into a lua table.
+ * values = vxReadArray(addr, count [, "type"])
+ */
+int l_vxReadArray(lua_State* luaVM)
+{
+    size_t     limit;
+    char *     addr  = memCheckAddrEx(luaVM, 1, &limit);
+    int        count = (int) luaL_checknumber(luaVM, 2);
+    int        type  = memCheckType(luaVM, 3);
+    size_t     size  = memTypeSizes[type];
+    int        i;
+
+    luaL_argcheck(luaVM, count >= 0, 2, "negative count");
+    memCheckLen(luaVM, 1, limit, (lua_Number) count * size);
+    lua_newtable(luaVM);
+    for (i = 0; i < count; i++)
+    {
+        memPeek(luaVM, addr + i * size, type);
+        lua_rawseti(luaVM, -2, i + 1);
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Writes the numbers of a lua table as an array of the given memory type.
+ * vxWriteArray(addr, values [, "type"])
+ */
+int l_vxWriteArray(lua_State* luaVM)
+{
+    size_t     limit;
+    char *     addr  = memCheckAddrEx(luaVM, 1, &limit);
+    int        type  = memCheckType(luaVM, 3);
+    size_t     size  = memTypeSizes[type];
+    int        count;
+    int        i;
+
+    luaL_checktype(luaVM, 2, LUA_TTABLE);
+    count = luaTableLen(luaVM, 2);
+    memCheckLen(luaVM, 1, limit, (lua_Number) count * size);
+    for (i = 0; i < count; i++)
+    {
+        lua_rawgeti(luaVM, 2, i + 1);
+        memPoke(luaVM, addr + i * size, type, -1);
+        lua_pop(luaVM, 1);
+    }
+    return 0;
+}
+
+
+/****************************************************************************** 
+ * Register access. 
+   vxReg32/16/8(addr [, value]) read or, with value, write one device 
+   register of exactly that width through a volatile pointer. Addresses are
+   numbers or lightuserdata, there is no symbol lookup. vxRegBlock(base 
+   [, width]) returns a register block indexed by byte offset:
+     regs = vxRegBlock(0xf0000000)   -- width 32 (default), 16 or 8
+     regs[0x10] = 1                  write base + 0x10
+     status = regs[0x14]             read base + 0x14
+     regs.base                       base address as lightuserdata
+   LUA_REG_BARRIER orders the accesses, it is a full memory barrier if the
+   architecture provides VX_MEM_BARRIER_RW.
+ *****************************************************************************/
+
+#ifndef LUA_REG_BARRIER
+#ifdef VX_MEM_BARRIER_RW
+#define LUA_REG_BARRIER()   VX_MEM_BARRIER_RW()
+#else
+#define LUA_REG_BARRIER()
+#endif
+#endif
+
+/* Metatable name of register blocks */
+#define REG_BLOCK_META      "vxLuaGlue.reg"
+
+/* Register block, the userdata returned by vxRegBlock */
+typedef struct {
+    char *  base;       /* base address */
+    int     width;      /* register width in bytes */
+} REG_BLOCK;
+
+/**
+ * Reads the register of width bytes at addr and pushes it, or writes the
+ * value at stack index valIdx to it if present. Returns the number of 
+ * values pushed.
+ */
+LOCAL int regAccess(lua_State* luaVM, char * addr, int width, int valIdx)
+{
+    UINT32 value;
+
+    if (((arg_word_t) addr & (width - 1)) != 0)
+    {
+        return luaL_error(luaVM, "unaligned %d bit register address", width * 8);
+    }
+
+    if (lua_isnoneornil(luaVM, valIdx))
+    {
+        LUA_REG_BARRIER();
+        switch (width)
+        {
+        case 1:  value = *(volatile UINT8 *)  addr; break;
+        case 2:  value = *(volatile UINT16 *) addr; break;
+        default: value = *(volatile UINT32 *) addr; break;
+        }
+        lua_pushnumber(luaVM, value);
+        return 1;   /* One value pushed onto the lua stack */	
+    }
+
+    /* Negative values as returned by vxDo are accepted as well */
+    value = (UINT32) (INT64) luaL_checknumber(luaVM, valIdx);
+    switch (width)
+    {
+    case 1:  *(volatile UINT8 *)  addr = (UINT8)  value; break;
+    case 2:  *(volatile UINT16 *) addr = (UINT16) value; break;
+    default: *(volatile UINT32 *) addr = value;          break;
+    }
+    LUA_REG_BARRIER();
+    return 0;
+}
+
+/**
+ * Reads or writes a 32 bit register.
+ * value = vxReg32(addr)  vxReg32(addr, value)
+ */
+int l_vxReg32(lua_State* luaVM)
+{
+    return regAccess(luaVM, memCheckAddr(luaVM, 1), 4, 2);
+}
+
+/**
+ * Reads or writes a 16 bit register.
+ * value = vxReg16(addr)  vxReg16(addr, value)
+ */
+int l_vxReg16(lua_State* luaVM)
+{
+    return regAccess(luaVM, memCheckAddr(luaVM, 1), 2, 2);
+}
+
+/**
+ * Reads or writes an 8 bit register.
+ * value = vxReg8(addr)  vxReg8(addr, value)
+ */
+int l_vxReg8(lua_State* luaVM)
+{
+    return regAccess(luaVM, memCheckAddr(luaVM, 1), 1, 2);
+}
+
+/**
+ * __index of register blocks, regs[offset] reads a register.
+ */
+LOCAL int l_vxRegIndex(lua_State* luaVM)
+{
+    REG_BLOCK * pBlk = (REG_BLOCK *) luaL_checkudata(luaVM, 1, REG_BLOCK_META);
+
+    if (lua_type(luaVM, 2) == LUA_TNUMBER)
+    {
+        return regAccess(luaVM, pBlk->base + (int) lua_tonumber(luaVM, 2), 
+                         pBlk->width, 3);
+    }
+    if (lua_isstring(luaVM, 2) && strcmp(lua_tostring(luaVM, 2), "base") == 0)
+    {
+        lua_pushlightuserdata(luaVM, pBlk->base);
+    }
+    else
+    {
+        lua_pushnil(luaVM);
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * __newindex of register blocks, regs[offset] = value writes a register.
+ */
+LOCAL int l_vxRegNewIndex(lua_State* luaVM)
+{
+    REG_BLOCK * pBlk = (REG_BLOCK *) luaL_checkudata(luaVM, 1, REG_BLOCK_META);
+
+    luaL_checktype(luaVM, 3, LUA_TNUMBER);
+    return regAccess(luaVM, pBlk->base + (int) luaL_checknumber(luaVM, 2), 
+                     pBlk->width, 3);
+}
+
+/**
+ * Creates the metatable of register blocks in a lua state.
+ */
+LOCAL void regBlockCreate(lua_State* luaVM)
+{
+    luaL_newmetatable(luaVM, REG_BLOCK_META);
+    lua_pushstring(luaVM, "__index");
+    lua_pushcfunction(luaVM, l_vxRegIndex);
+    lua_rawset(luaVM, -3);
+    lua_pushstring(luaVM, "__newindex");
+    lua_pushcfunction(luaVM, l_vxRegNewIndex);
+    lua_rawset(luaVM, -3);
+    lua_pop(luaVM, 1);
+}
+
+/**
+ * Returns a block of registers of width bits (default 32) at base.
+ * regs = vxRegBlock(base [, width])
+ */
+int l_vxRegBlock(lua_State* luaVM)
+{
+    char *      base  = memCheckAddr(luaVM, 1);
+    int         width = (int) luaL_optnumber(luaVM, 2, 32);
+    REG_BLOCK * pBlk;
+
+    luaL_argcheck(luaVM, width == 32 || width == 16 || width == 8, 2, 
+                  "width 32, 16 or 8 expected");
+    pBlk = (REG_BLOCK *) lua_newuserdata(luaVM, sizeof(REG_BLOCK));
+    pBlk->base  = base;
+    pBlk->width = width / 8;
+
+    luaL_getmetatable(luaVM, REG_BLOCK_META);
+    lua_setmetatable(luaVM, -2);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+
+/****************************************************************************** 
+ * Buffers. 
+   vxBuffer(n) allocates n zeroed bytes owned by lua. Passed to vxDo and the
+   other calls, a buffer is the pointer to its storage, so C functions can 
+   fill it without a malloc/free pair. A slice is a view into its parent 
+   buffer, which it keeps alive.
+     #buf                    length in bytes
+     buf:ptr()               storage pointer as lightuserdata
+     buf:slice(offset[,len]) view of len bytes from byte offset (0 based)
+     tostring(buf)           the contents as lua string
+ *****************************************************************************/
+
+/* Metatable name of buffers */
+#define LUA_BUFFER_META     "vxLuaGlue.buffer"
+
+/* Buffer header, the userdata returned by vxBuffer and slice */
+typedef struct {
+    char *  data;       /* storage, behind the header or in the parent */
+    size_t  len;        /* length in bytes */
+    int     parentRef;  /* registry reference of the parent, or of the 
+                           values a struct points to, or LUA_NOREF */
+} LUA_BUFFER;
+
+/* Offset of the storage of a buffer, keeps doubles aligned */
+#define LUA_BUFFER_HDR      ((sizeof(LUA_BUFFER) + 7) & ~7)
+
+/**
+ * Returns the buffer at stack index idx, or NULL for any other value.
+ */
+LOCAL LUA_BUFFER * luaBufferTest(lua_State* luaVM, int idx)
+{
+    LUA_BUFFER * pBuf = NULL;
+
+    if (lua_isuserdata(luaVM, idx) && lua_getmetatable(luaVM, idx))
+    {
+        luaL_getmetatable(luaVM, LUA_BUFFER_META);
+        if (lua_rawequal(luaVM, -1, -2))
+        {
+            pBuf = (LUA_BUFFER *) lua_touserdata(luaVM, idx);
+        }
+        lua_pop(luaVM, 2);
+    }
+    return pBuf;
+}
+
+/**
+ * Returns the storage of the buffer at stack index idx and its length in 
+ * *pLen (if not NULL), or NULL if the value is no buffer.
+ */
+LOCAL char * luaBufferData(lua_State* luaVM, int idx, size_t * pLen)
+{
+    LUA_BUFFER * pBuf = luaBufferTest(luaVM, idx);
+
+    if (pBuf == NULL)
+    {
+        return NULL;
+    }
+    if (pLen != NULL)
+    {
+        *pLen = pBuf->len;
+    }
+    return pBuf->data;
+}
+
+/**
+ * Returns the buffer at stack index idx, raises a lua error otherwise.
+ */
+LOCAL LUA_BUFFER * luaBufferCheck(lua_State* luaVM, int idx)
+{
+    return (LUA_BUFFER *) luaL_checkudata(luaVM, idx, LUA_BUFFER_META);
+}
+
+/**
+ * Pushes a new buffer with len zeroed bytes and returns its storage.
+ */
+LOCAL char * luaBufferNew(lua_State* luaVM, size_t len)
+{
+    LUA_BUFFER * pBuf;
+
+    pBuf = (LUA_BUFFER *) lua_newuserdata(luaVM, LUA_BUFFER_HDR + len);
+    pBuf->data      = (char *) pBuf + LUA_BUFFER_HDR;
+    pBuf->len       = len;
+    pBuf->parentRef = LUA_NOREF;
+    memset(pBuf->data, 0, pBuf->len);
+
+    luaL_getmetatable(luaVM, LUA_BUFFER_META);
+    lua_setmetatable(luaVM, -2);
+    return pBuf->data;
+}
+
+/**
+ * Allocates a buffer with n zeroed bytes.
+ * buf = vxBuffer(n)
+ */
+int l_vxBuffer(lua_State* luaVM)
+{
+    lua_Number   n = luaL_checknumber(luaVM, 1);
+
+    luaL_argcheck(luaVM, n >= 0, 1, "negative size");
+    luaBufferNew(luaVM, (size_t) n);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Returns a view into a buffer.
+ * view = buf:slice(offset [, len])
+ */
+LOCAL int l_vxBufferSlice(lua_State* luaVM)
+{
+    LUA_BUFFER * pBuf = luaBufferCheck(luaVM, 1);
+    lua_Number   off  = luaL_checknumber(luaVM, 2);
+    lua_Number   len  = luaL_optnumber(luaVM, 3, (lua_Number) pBuf->len - off);
+    LUA_BUFFER * pView;
+
+    luaL_argcheck(luaVM, off >= 0 && off <= (lua_Number) pBuf->len, 2, "offset out of range");
+    luaL_argcheck(luaVM, len >= 0 && off + len <= (lua_Number) pBuf->len, 3, "length out of range");
+
+    pView = (LUA_BUFFER *) lua_newuserdata(luaVM, sizeof(LUA_BUFFER));
+    pView->data      = pBuf->data + (size_t) off;
+    pView->len       = (size_t) len;
+    pView->parentRef = LUA_NOREF;
+
+    luaL_getmetatable(luaVM, LUA_BUFFER_META);
+    lua_setmetatable(luaVM, -2);
+
+    lua_pushvalue(luaVM, 1);
+    pView->parentRef = luaL_ref(luaVM, LUA_REGISTRYINDEX);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Returns the storage pointer of a buffer.
+ */
+LOCAL int l_vxBufferPtr(lua_State* luaVM)
+{
+    lua_pushlightuserdata(luaVM, luaBufferCheck(luaVM, 1)->data);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * __len of buffers.
+ */
+LOCAL int l_vxBufferLen(lua_State* luaVM)
+{
+    lua_pushnumber(luaVM, (lua_Number) luaBufferCheck(luaVM, 1)->len);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * __tostring of buffers.
+ */
+LOCAL int l_vxBufferToString(lua_State* luaVM)
+{
+    LUA_BUFFER * pBuf = luaBufferCheck(luaVM, 1);
+
+    lua_pushlstring(luaVM, pBuf->data, pBuf->len);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * __gc of buffers, a slice releases its parent.
+ */
+LOCAL int l_vxBufferGc(lua_State* luaVM)
+{
+    LUA_BUFFER * pBuf = luaBufferCheck(luaVM, 1);
+
+    luaL_unref(luaVM, LUA_REGISTRYINDEX, pBuf->parentRef);
+    pBuf->parentRef = LUA_NOREF;
+    return 0;
+}
+
+LOCAL const lua_command_info luaBufferMethods[] = {
+    { "slice",                  l_vxBufferSlice         },
+    { "ptr",                    l_vxBufferPtr           },
+    {0,0}
+};
+
+LOCAL const lua_command_info luaBufferMetaMethods[] = {
+    { "__len",                  l_vxBufferLen           },
+    { "__tostring",             l_vxBufferToString      },
+    { "__gc",                   l_vxBufferGc            },
+    {0,0}
+};
+
+/**
+ * Creates the metatable of buffers in a lua state.
+ */
+LOCAL void luaBufferCreate(lua_State* luaVM)
+{
+    int i;
+
+    luaL_newmetatable(luaVM, LUA_BUFFER_META);
+    for (i = 0; luaBufferMetaMethods[i].name; i++)
+    {
+        lua_pushstring(luaVM, luaBufferMetaMethods[i].name);
+        lua_pushcfunction(luaVM, luaBufferMetaMethods[i].func);
+        lua_rawset(luaVM, -3);
+    }
+
+    lua_pushstring(luaVM, "__index");
+    lua_newtable(luaVM);
+    for (i = 0; luaBufferMethods[i].name; i++)
+    {
+        lua_pushstring(luaVM, luaBufferMethods[i].name);
+        lua_pushcfunction(luaVM, luaBufferMethods[i].func);
+        lua_rawset(luaVM, -3);
+    }
+    lua_rawset(luaVM, -3);
+    lua_pop(luaVM, 1);
+}
+
+
+/****************************************************************************** 
+ * Table arguments. 
+   The array part of a table argument is passed as a C array, by default 
+   of i32. A type field selects another memory type:
+     vxDo("dsp_sum", {1.5, 2.5, 3.5, type = "double"}, 3)
+   The array lives in a scratch arena of the lua state until the call 
+   returns, so C functions must not keep the pointer. Arrays that do not fit 
+   into the arena are allocated as lua userdata instead. Use a vxBuffer for 
+   output data.
+   vxStruct(layout, values) packs values into a buffer with the C layout of
+   the struct described by the layout characters:
+     b B  i8 u8     h H  i16 u16    i I  i32 u32    l L  i64 u64
+     f    float     d    double     p    pointer
+   Members are aligned as the compiler of this file aligns them in a struct,
+   e.g. doubles to 4 bytes on i386. Strings and buffers of p members are 
+   kept alive as long as the struct buffer.
+ *****************************************************************************/
+
+/* Size of the scratch arena of a lua state */
+#define LUA_SCRATCH_SIZE    4096
+
+/* Scratch arena, a bump allocator stored as userdata in the registry */
+typedef struct luaScratch {
+    size_t  used;       /* fill level */
+    size_t  size;       /* size of data */
+    UINT32  cbPending;  /* callback thunks of the calls that are active */
+    double  data[1];    /* storage, double for its alignment */
+} LUA_SCRATCH;
+
+/* Its address is the registry key of the scratch arena */
+LOCAL char scratchKey;
+
+/**
+ * Creates the scratch arena in the registry of a lua state.
+ */
+LOCAL void luaScratchCreate(lua_State* luaVM)
+{
+    LUA_SCRATCH * pScratch;
+
+    lua_pushlightuserdata(luaVM, &scratchKey);
+    pScratch = (LUA_SCRATCH *) lua_newuserdata(luaVM, 
+                                   sizeof(LUA_SCRATCH) + LUA_SCRATCH_SIZE);
+    pScratch->used      = 0;
+    pScratch->size      = LUA_SCRATCH_SIZE;
+    pScratch->cbPending = 0;
+    lua_rawset(luaVM, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Returns the scratch arena of a lua state.
+ */
+LOCAL LUA_SCRATCH * luaScratchGet(lua_State* luaVM)
+{
+    LUA_SCRATCH * pScratch;
+
+    lua_pushlightuserdata(luaVM, &scratchKey);
+    lua_rawget(luaVM, LUA_REGISTRYINDEX);
+    pScratch = (LUA_SCRATCH *) lua_touserdata(luaVM, -1);
+    lua_pop(luaVM, 1);
+    return pScratch;
+}
+
+/**
+ * Empties the scratch arena and frees the callback thunks of the calls
+ * after a lua error skipped luaCallScopeEnd. Only call this when no call 
+ * is active.
+ */
+LOCAL void luaScratchReset(lua_State* luaVM)
+{
+    LUA_SCRATCH * pScratch = luaScratchGet(luaVM);
+
+    if (pScratch != NULL)
+    {
+        pScratch->used = 0;
+        if (pScratch->cbPending != 0)
+        {
+            cbReleaseMask(luaVM, pScratch->cbPending);
+            pScratch->cbPending = 0;
+        }
+    }
+}
+
+/**
+ * Returns the scratch arena for a call, and marks its fill level when the 
+ * call first uses it.
+ */
+LOCAL LUA_SCRATCH * luaScopeScratch(lua_State* luaVM, LUA_CALL_SCOPE * pScope)
+{
+    if (pScope->pScratch == NULL)
+    {
+        pScope->pScratch = luaScratchGet(luaVM);
+        pScope->mark     = pScope->pScratch->used;
+    }
+    return pScope->pScratch;
+}
+
+/**
+ * Allocates len bytes for the current call. The memory comes from the 
+ * scratch arena, or from a userdata left on the lua stack when the arena is 
+ * full.
+ */
+LOCAL char * luaScratchAlloc(lua_State* luaVM, LUA_CALL_SCOPE * pScope, size_t len)
+{
+    LUA_SCRATCH * pScratch = luaScopeScratch(luaVM, pScope);
+    char *        p;
+
+    len = (len + 7) & ~7;
+
+    if (pScratch->size - pScratch->used >= len)
+    {
+        p = (char *) pScratch->data + pScratch->used;
+        pScratch->used += len;
+        return p;
+    }
+
+    /* The stack slot keeps it alive until the call returns */
+    luaL_checkstack(luaVM, 1, "too many table arguments");
+    return (char *) lua_newuserdata(luaVM, len);
+}
+
+/**
+ * Releases the memory and the callback thunks of all arguments of a call.
+ */
+LOCAL void luaCallScopeEnd(lua_State* luaVM, LUA_CALL_SCOPE * pScope)
+{
+    if (pScope->pScratch != NULL)
+    {
+        pScope->pScratch->used = pScope->mark;
+        pScope->pScratch->cbPending &= ~pScope->cbMask;
+        pScope->pScratch = NULL;
+    }
+    if (pScope->cbMask != 0)
+    {
+        cbReleaseMask(luaVM, pScope->cbMask);
+        pScope->cbMask = 0;
+    }
+}
+
+/**
+ * Returns the memory type selected by the type field of the table at stack 
+ * index idx, i32 if it has none. Raises a lua error for unknown types.
+ */
+LOCAL int luaTableType(lua_State* luaVM, int idx)
+{
+    int type = MEM_I32;
+
+    lua_pushstring(luaVM, "type");
+    lua_rawget(luaVM, idx);
+    if (lua_isstring(luaVM, -1))
+    {
+        type = memFindType(lua_tostring(luaVM, -1));
+        if (type < 0)
+        {
+            luaL_error(luaVM, "unknown array type %s", lua_tostring(luaVM, -1));
+        }
+    }
+    lua_pop(luaVM, 1);
+    return type;
+}
+
+/**
+ * Copies the array part of the table at stack index idx into memory of the
+ * current call and returns its address. Values that are no numbers are 0.
+ */
+LOCAL arg_word_t luaTableToArray(lua_State* luaVM, int idx, LUA_CALL_SCOPE * pScope)
+{
+    int    type;
+    size_t size;
+    int    count;
+    char * p;
+    int    i;
+
+    if (idx < 0)
+    {
+        idx = lua_gettop(luaVM) + idx + 1;
+    }
+    type  = luaTableType(luaVM, idx);
+    size  = memTypeSizes[type];
+    count = luaTableLen(luaVM, idx);
+
+    p = luaScratchAlloc(luaVM, pScope, count * size + 1);
+    for (i = 0; i < count; i++)
+    {
+        lua_rawgeti(luaVM, idx, i + 1);
+        if (lua_type(luaVM, -1) != LUA_TNUMBER)
+        {
+            lua_pop(luaVM, 1);
+            lua_pushnumber(luaVM, 0);
+        }
+        memPoke(luaVM, p + i * size, type, -1);
+        lua_pop(luaVM, 1);
+    }
+    return (arg_word_t) p;
+}
+
+/**
+ * Returns the memory type of a struct layout character, or -1.
+ */
+LOCAL int structMemType(char c)
+{
+    switch (c)
+    {
+    case 'b': return MEM_I8;
+    case 'B': return MEM_U8;
+    case 'h': return MEM_I16;
+    case 'H': return MEM_U16;
+    case 'i': return MEM_I32;
+    case 'I': return MEM_U32;
+    case 'l': return MEM_I64;
+    case 'L': return MEM_U64;
+    case 'f': return MEM_FLOAT;
+    case 'd': return MEM_DOUBLE;
+    default:  return -1;
+    }
+}
+
+/* Alignment of pointer members */
+typedef struct { char c; arg_word_t t; } MEM_ALIGN_WORD;
+
+/**
+ * Packs the values of a table into a buffer with a C struct layout.
+ * buf = vxStruct("iid", {1, 2, 0.5})
+ */
+int l_vxStruct(lua_State* luaVM)
+{
+    const char * layout = luaL_checkstring(luaVM, 1);
+    const char * c;
+    size_t       size;
+    size_t       align;
+    size_t       maxAlign = 1;
+    size_t       off = 0;
+    char *       p;
+    int          type;
+    int          pass;
+    int          nAnchors = 0;
+    int          i;
+
+    luaL_checktype(luaVM, 2, LUA_TTABLE);
+
+    /* The first pass computes the size, the second one packs. The table 
+       on top of the buffer anchors what p members point to. */
+    for (pass = 0; pass < 2; pass++)
+    {
+        p = NULL;
+        if (pass == 1)
+        {
+            p = luaBufferNew(luaVM, off);
+            lua_newtable(luaVM);
+        }
+        off = 0;
+        for (c = layout, i = 1; *c != '\0'; c++, i++)
+        {
+            type = structMemType(*c);
+            if (*c == 'p')
+            {
+                size  = sizeof(arg_word_t);
+                align = offsetof(MEM_ALIGN_WORD, t);
+            }
+            else if (type >= 0)
+            {
+                size  = memTypeSizes[type];
+                align = memTypeAligns[type];
+            }
+            else
+            {
+                return luaL_argerror(luaVM, 1, "unknown layout character");
+            }
+
+            off = (off + align - 1) & ~(align - 1);
+            if (align > maxAlign)
+            {
+                maxAlign = align;
+            }
+
+            if (p != NULL)
+            {
+                lua_rawgeti(luaVM, 2, i);
+                if (*c == 'p')
+                {
+                    *(arg_word_t *) (p + off) = luaArgToWord(luaVM, -1, NULL);
+                    if (lua_type(luaVM, -1) == LUA_TSTRING || 
+                        lua_type(luaVM, -1) == LUA_TUSERDATA)
+                    {
+                        lua_rawseti(luaVM, -2, ++nAnchors);
+                    }
+                    else
+                    {
+                        lua_pop(luaVM, 1);
+                    }
+                }
+                else
+                {
+                    if (lua_type(luaVM, -1) == LUA_TNUMBER)
+                    {
+                        memPoke(luaVM, p + off, type, -1);
+                    }
+                    lua_pop(luaVM, 1);
+                }
+            }
+            off += size;
+        }
+        off = (off + maxAlign - 1) & ~(maxAlign - 1);
+    }
+
+    if (nAnchors > 0)
+    {
+        ((LUA_BUFFER *) lua_touserdata(luaVM, -2))->parentRef = 
+            luaL_ref(luaVM, LUA_REGISTRYINDEX);
+    }
+    else
+    {
+        lua_pop(luaVM, 1);
+    }
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+
+/****************************************************************************** 
+ * Lua callbacks. 
+   A lua function passed to vxDo is passed as a C function pointer. Called 
+   from C, it runs the lua function with the arguments as integer numbers 
+   and returns its result converted like a vxDo argument (strings excluded).
+   Such a callback is only valid until the call returns, e.g. for qsort. 
+   vxCallback(fn [, nArgs]) returns one that stays valid until it is freed 
+   with vxCallbackFree(cb), e.g. for taskSpawn or an event registration:
+     cb = vxCallback(function(ev, arg) print(ev, arg) return 0 end, 2)
+     vxDo("eventRegister", cb, 0)  ...  vxCallbackFree(cb)
+   The callbacks are a fixed pool of CB_POOL_SIZE C thunks. A callback from 
+   another task waits until the lua context is not running lua code of the 
+   task that owns it. On the owning task, e.g. qsort called from lua, the 
+   function is called right away. Callbacks must not be called from 
+   interrupt level (e.g. by a watchdog), they return 0 there.
+ *****************************************************************************/
+
+#define CB_POOL_SIZE    16      /* number of thunks, see CB_THUNK below */
+#define CB_MAX_ARGS     8       /* argument words passed to a thunk */
+
+/* Thunk slot */
+typedef struct {
+    TSYS_LUA_ID ctx;        /* context of the lua function, NULL if free */
+    int         ref;        /* registry reference of the lua function */
+    int         nArgs;      /* number of arguments passed to it */
+    UINT32      gen;        /* incremented at every allocation */
+} CB_SLOT;
+
+LOCAL CB_SLOT cbSlots[CB_POOL_SIZE];
+LOCAL SEM_ID  cbSem = NULL;             /* guards the allocation of slots */
+
+/**
+ * Returns the context of a lua state.
+ */
+LOCAL TSYS_LUA_ID luaCtxGet(lua_State* luaVM)
+{
+    TSYS_LUA_ID ctx;
+
+    lua_pushlightuserdata(luaVM, &luaCtxKey);
+    lua_rawget(luaVM, LUA_REGISTRYINDEX);
+    ctx = (TSYS_LUA_ID) lua_touserdata(luaVM, -1);
+    lua_pop(luaVM, 1);
+    return ctx;
+}
+
+/**
+ * Makes the calling task the one running lua code in a context. Returns 
+ * FALSE when it already is, i.e. lua called C which calls back into lua.
+ */
+LOCAL BOOL luaCtxEnter(TSYS_LUA_ID ctx)
+{
+    int self = (int) taskIdSelf();
+
+    if (ctx->ownerTid == self)
+    {
+        return FALSE;
+    }
+    semTake(ctx->runSem, WAIT_FOREVER);
+    ctx->ownerTid = self;
+    return TRUE;
+}
+
+/**
+ * Undoes luaCtxEnter.
+ */
+LOCAL void luaCtxLeave(TSYS_LUA_ID ctx, BOOL entered)
+{
+    if (entered)
+    {
+        ctx->ownerTid = 0;
+        semGive(ctx->runSem);
+    }
+}
+
+/**
+ * Runs the lua function of thunk n with the argument words args.
+ */
+LOCAL arg_word_t cbDispatch(int n, arg_word_t * args)
+{
+    CB_SLOT *   pSlot = &cbSlots[n];
+    TSYS_LUA_ID ctx   = pSlot->ctx;
+    UINT32      gen   = pSlot->gen;
+    lua_State * luaVM;
+    arg_word_t  result = 0;
+    BOOL        entered;
+    int         i;
+
+    if (ctx == NULL || intContext())
+    {
+        return 0;
+    }
+
+    /* The slot may have been freed or reused while waiting for the context,
+       it only changes while the context runs */
+    entered = luaCtxEnter(ctx);
+    if (pSlot->ctx != ctx || pSlot->gen != gen)
+    {
+        luaCtxLeave(ctx, entered);
+        return 0;
+    }
+    luaVM = ctx->luaVM;
+    if (lua_checkstack(luaVM, pSlot->nArgs + 1))
+    {
+        lua_rawgeti(luaVM, LUA_REGISTRYINDEX, pSlot->ref);
+        for (i = 0; i < pSlot->nArgs; i++)
+        {
+            lua_pushnumber(luaVM, (lua_Number) (long) args[i]);
+        }
+        if (lua_pcall(luaVM, pSlot->nArgs, 1, 0) != 0)
+        {
+            luaLog("vxCallback: %s", lua_tostring(luaVM, -1));
+        }
+        else if (!lua_isstring(luaVM, -1) || lua_isnumber(luaVM, -1))
+        {
+            result = luaArgToWord(luaVM, -1, NULL);
+        }
+        lua_pop(luaVM, 1);
+    }
+    luaCtxLeave(ctx, entered);
+    return result;
+}
+
+/* C thunk n of the pool */
+#define CB_THUNK(n) \
+LOCAL arg_word_t cbThunk##n(arg_word_t a0, arg_word_t a1, arg_word_t a2, arg_word_t a3, \
+                            arg_word_t a4, arg_word_t a5, arg_word_t a6, arg_word_t a7) \
+{ \
+    arg_word_t args[CB_MAX_ARGS]; \
+    args[0] = a0; args[1] = a1; args[2] = a2; args[3] = a3; \
+    args[4] = a4; args[5] = a5; args[6] = a6; args[7] = a7; \
+    return cbDispatch(n, args); \
+}
+
+CB_THUNK(0)
+CB_THUNK(1)
+CB_THUNK(2)
+CB_THUNK(3)
+CB_THUNK(4)
+CB_THUNK(5)
+CB_THUNK(6)
+CB_THUNK(7)
+CB_THUNK(8)
+CB_THUNK(9)
+CB_THUNK(10)
+CB_THUNK(11)
+CB_THUNK(12)
+CB_THUNK(13)
+CB_THUNK(14)
+CB_THUNK(15)
+
+LOCAL const FUNCPTR cbThunks[CB_POOL_SIZE] = {
+    (FUNCPTR) cbThunk0, (FUNCPTR) cbThunk1, (FUNCPTR) cbThunk2, (FUNCPTR) cbThunk3, (FUNCPTR) cbThunk4, (FUNCPTR) cbThunk5, (FUNCPTR) cbThunk6, (FUNCPTR) cbThunk7,
+    (FUNCPTR) cbThunk8, (FUNCPTR) cbThunk9, (FUNCPTR) cbThunk10, (FUNCPTR) cbThunk11, (FUNCPTR) cbThunk12, (FUNCPTR) cbThunk13, (FUNCPTR) cbThunk14, (FUNCPTR) cbThunk15
+};
+
+/**
+ * Allocates a thunk for the lua function at stack index idx, which is
+ * called with nArgs arguments. Returns the thunk number, raises a lua error 
+ * when the pool is exhausted.
+ */
+LOCAL int cbAlloc(lua_State* luaVM, int idx, int nArgs)
+{
+    TSYS_LUA_ID ctx = luaCtxGet(luaVM);
+    int         n;
+
+    semTake(cbSem, WAIT_FOREVER);
+    for (n = 0; n < CB_POOL_SIZE && cbSlots[n].ctx != NULL; n++)
+        ;
+    if (n < CB_POOL_SIZE)
+    {
+        lua_pushvalue(luaVM, idx);
+        cbSlots[n].ref   = luaL_ref(luaVM, LUA_REGISTRYINDEX);
+        cbSlots[n].nArgs = nArgs;
+        cbSlots[n].gen++;
+        cbSlots[n].ctx   = ctx;     /* published last */
+    }
+    semGive(cbSem);
+
+    if (n == CB_POOL_SIZE)
+    {
+        return luaL_error(luaVM, "no free callback, %d in use", CB_POOL_SIZE);
+    }
+    return n;
+}
+
+/**
+ * Frees thunk n.
+ */
+LOCAL void cbFree(lua_State* luaVM, int n)
+{
+    semTake(cbSem, WAIT_FOREVER);
+    cbSlots[n].ctx = NULL;
+    luaL_unref(luaVM, LUA_REGISTRYINDEX, cbSlots[n].ref);
+    semGive(cbSem);
+}
+
+/**
+ * Frees the thunks of a bit mask of thunk numbers.
+ */
+LOCAL void cbReleaseMask(lua_State* luaVM, UINT32 mask)
+{
+    int n;
+
+    for (n = 0; n < CB_POOL_SIZE; n++)
+    {
+        if (mask & (1u << n))
+        {
+            cbFree(luaVM, n);
+        }
+    }
+}
+
+/**
+ * Frees all thunks of a context that is destroyed.
+ */
+LOCAL void cbReleaseCtx(TSYS_LUA_ID ctx)
+{
+    int n;
+
+    for (n = 0; n < CB_POOL_SIZE; n++)
+    {
+        if (cbSlots[n].ctx == ctx)
+        {
+            cbFree(ctx->luaVM, n);
+        }
+    }
+}
+
+/**
+ * Returns a thunk calling the lua function at stack index idx, which is
+ * freed when the current call returns. The scratch arena records it as 
+ * well, so a lua error raised before the call returns does not leak it.
+ */
+LOCAL arg_word_t luaFunctionToThunk(lua_State* luaVM, int idx, LUA_CALL_SCOPE * pScope)
+{
+    LUA_SCRATCH * pScratch = luaScopeScratch(luaVM, pScope);
+    int           n = cbAlloc(luaVM, idx, CB_MAX_ARGS);
+
+    pScope->cbMask |= 1u << n;
+    pScratch->cbPending |= 1u << n;
+    return (arg_word_t) cbThunks[n];
+}
+
+/**
+ * Returns a C function pointer calling a lua function, until it is freed.
+ * cb = vxCallback(fn [, nArgs])
+ */
+int l_vxCallback(lua_State* luaVM)
+{
+    int nArgs = (int) luaL_optnumber(luaVM, 2, CB_MAX_ARGS);
+
+    luaL_checktype(luaVM, 1, LUA_TFUNCTION);
+    luaL_argcheck(luaVM, nArgs >= 0 && nArgs <= CB_MAX_ARGS, 2, "invalid argument count");
+    lua_pushlightuserdata(luaVM, (void *) cbThunks[cbAlloc(luaVM, 1, nArgs)]);
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+/**
+ * Frees a callback returned by vxCallback.
+ * vxCallbackFree(cb)
+ */
+int l_vxCallbackFree(lua_State* luaVM)
+{
+    void *      cb  = lua_touserdata(luaVM, 1);
+    TSYS_LUA_ID ctx = luaCtxGet(luaVM);
+    int         n;
+
+    for (n = 0; n < CB_POOL_SIZE; n++)
+    {
+        if ((void *) cbThunks[n] == cb && cbSlots[n].ctx == ctx)
+        {
+            cbFree(luaVM, n);
+            return 0;
+        }
+    }
+    return luaL_argerror(luaVM, 1, "no callback of this lua state");
+}
+
+
+/**
+ * You can add c functions to Lua like this.
+ */
+int l_myLuaFunction(lua_State* luaVM)
+{
+    return 0;   
+}
+
+/****************************************************************************** 
+ * Compiled chunk cache. 
+ *****************************************************************************/
+
+/* Its address is the registry key of the chunk cache table, which maps a 
+   script path to { chunk, mtime, size } */
+LOCAL char chunkCacheKey;
+
+/**
+ * Creates the chunk cache table in the registry of a lua state.
+ */
+LOCAL void chunkCacheCreate(lua_State* luaVM)
+{
+    lua_pushlightuserdata(luaVM, &chunkCacheKey);
+    lua_newtable(luaVM);
+    lua_rawset(luaVM, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Pushes the compiled chunk of a script onto the lua stack. The chunk is 
+ * only loaded from the file system when the file is not cached yet, or its
+ * modification time or size changed since it was cached.
+ * Returns 0 or a lua error code with the error message pushed instead.
+ */
+LOCAL int chunkCacheLoad(lua_State* luaVM, const char * luaScriptPath)
+{
+    struct stat st;
+    int         error;
+
+    if (stat((char *) luaScriptPath, &st) != OK)
+    {
+        return luaL_loadfile(luaVM, luaScriptPath);  /* reports the error */
+    }
+
+    lua_pushlightuserdata(luaVM, &chunkCacheKey);
+    lua_rawget(luaVM, LUA_REGISTRYINDEX);
+    lua_pushstring(luaVM, luaScriptPath);
+    lua_rawget(luaVM, -2);
+    if (lua_istable(luaVM, -1))
+    {
+        lua_rawgeti(luaVM, -1, 2);
+        lua_rawgeti(luaVM, -2, 3);
+        if (lua_tonumber(luaVM, -2) == (lua_Number) st.st_mtime &&
+            lua_tonumber(luaVM, -1) == (lua_Number) st.st_size)
+        {
+            lua_rawgeti(luaVM, -3, 1);
+            lua_replace(luaVM, -5);         /* chunk replaces the cache table */
+            lua_pop(luaVM, 3);
+            return 0;
+        }
+        lua_pop(luaVM, 2);
+    }
+    lua_pop(luaVM, 1);
+
+    error = luaL_loadfile(luaVM, luaScriptPath);
+    if (error)
+    {
+        lua_remove(luaVM, -2);
+        return error;
+    }
+
+    lua_pushstring(luaVM, luaScriptPath);
+    lua_newtable(luaVM);
+    lua_pushvalue(luaVM, -3);
+    lua_rawseti(luaVM, -2, 1);
+    lua_pushnumber(luaVM, (lua_Number) st.st_mtime);
+    lua_rawseti(luaVM, -2, 2);
+    lua_pushnumber(luaVM, (lua_Number) st.st_size);
+    lua_rawseti(luaVM, -2, 3);
+    lua_rawset(luaVM, -4);                  /* cache[path] = entry */
+    lua_remove(luaVM, -2);
+    return 0;
+}
+
+/**
+ * Drops all cached chunks of a context, so the next runs load every script
+ * again. Needed if a script is changed without changing its size within the
+ * time resolution of the file system.
+ */
+void TSysLuaChunkCacheFlush(TSYS_LUA_ID ctx)
+{
+    if (ctx != NULL)
+    {
+        chunkCacheCreate(ctx->luaVM);
+    }
+}
+
+/****************************************************************************** 
+ * Lua memory arena. 
+ *****************************************************************************/
+#if defined(LUA_5_2) || defined(LUA_5_1)
+
+/* Small blocks are rounded up to 16, 32, ... 256 bytes. Freed small blocks 
+   are kept in a free list per size class instead of being returned to the 
+   partition, which makes the strings, tables and closures lua churns through
+   cheap to allocate and keeps the partition from fragmenting. */
+#define LUA_ARENA_MIN_SIZE      16
+#define LUA_ARENA_CLASSES       5
+
+/* Private memory partition of one lua state */
+typedef struct luaArena {
+    char *      pool;                           /* memory of the partition */
+    PART_ID     partId;                         /* the partition */
+    void *      freeList[LUA_ARENA_CLASSES];    /* free small blocks */
+    size_t      inUse;                          /* bytes used by lua */
+} LUA_ARENA;
+
+/**
+ * Returns the size class of a block, -1 for blocks above the largest class.
+ */
+LOCAL int luaArenaClass(size_t size)
+{
+    int    cls;
+    size_t clsSize = LUA_ARENA_MIN_SIZE;
+
+    for (cls = 0; cls < LUA_ARENA_CLASSES; cls++, clsSize <<= 1)
+    {
+        if (size <= clsSize)
+            return cls;
+    }
+    return -1;
+}
+
+/**
+ * Frees a block of the given size.
+ */
+LOCAL void luaArenaFree(LUA_ARENA * pArena, void * ptr, size_t size)
+{
+    int cls = luaArenaClass(size);
+
+    pArena->inUse -= size;
+    if (cls < 0)
+    {
+        memPartFree(pArena->partId, (char *) ptr);
+    }
+    else
+    {
+        *(void **) ptr = pArena->freeList[cls];
+        pArena->freeList[cls] = ptr;
+    }
+}
+
+/**
+ * Allocates a block of the given size.
+ */
+LOCAL void * luaArenaGet(LUA_ARENA * pArena, size_t size)
+{
+    int    cls = luaArenaClass(size);
+    void * ptr;
+
+    if (cls < 0)
+    {
+        ptr = memPartAlloc(pArena->partId, size);
+    }
+    else if (pArena->freeList[cls] != NULL)
+    {
+        ptr = pArena->freeList[cls];
+        pArena->freeList[cls] = *(void **) ptr;
+    }
+    else
+    {
+        ptr = memPartAlloc(pArena->partId, LUA_ARENA_MIN_SIZE << cls);
+    }
+
+    if (ptr != NULL)
+        pArena->inUse += size;
+    return ptr;
+}
+
+/**
+ * The lua_Alloc function of states with a private partition.
+ */
+LOCAL void * luaArenaAlloc(void * ud, void * ptr, size_t osize, size_t nsize)
+{
+    LUA_ARENA * pArena = (LUA_ARENA *) ud;
+    void *      pNew;
+    int         ocls;
+
+    if (ptr == NULL)
+    {
+        osize = 0;      /* Lua 5.2 passes the object type in osize */
+    }
+
+    if (nsize == 0)
+    {
+        if (ptr != NULL)
+            luaArenaFree(pArena, ptr, osize);
+        return NULL;
+    }
+
+    if (ptr != NULL)
+    {
+        ocls = luaArenaClass(osize);
+        if (ocls >= 0 && ocls == luaArenaClass(nsize))
+        {
+            pArena->inUse += nsize - osize;
+            return ptr;     /* still fits its block */
+        }
+        if (ocls < 0 && luaArenaClass(nsize) < 0)
+        {
+            pNew = memPartRealloc(pArena->partId, (char *) ptr, nsize);
+            if (pNew != NULL)
+                pArena->inUse += nsize - osize;
+            else if (nsize < osize)
+                return ptr; /* lua expects shrinking to succeed */
+            return pNew;
+        }
+    }
+
+    pNew = luaArenaGet(pArena, nsize);
+    if (pNew == NULL)
+    {
+        /* Shrinking must not fail, the old block is large enough. Its size
+           is from now on taken as nsize, which is still a valid class. */
+        if (ptr != NULL && nsize < osize)
+        {
+            pArena->inUse += nsize - osize;
+            return ptr;
+        }
+        return NULL;
+    }
+
+    if (ptr != NULL)
+    {
+        memcpy(pNew, ptr, (osize < nsize) ? osize : nsize);
+        luaArenaFree(pArena, ptr, osize);
+    }
+    return pNew;
+}
+
+/**
+ * Creates a private partition of the given size.
+ */
+LOCAL LUA_ARENA * luaArenaCreate(size_t size)
+{
+    LUA_ARENA * pArena;
+
+    pArena = (LUA_ARENA *) calloc(1, sizeof(LUA_ARENA));
+    if (pArena == NULL)
+    {
+        return NULL;
+    }
+
+    pArena->pool = (char *) malloc(size);
+    if (pArena->pool != NULL)
+    {
+        pArena->partId = memPartCreate(pArena->pool, size);
+    }
+    if (pArena->partId == NULL)
+    {
+        free(pArena->pool);
+        free(pArena);
+        return NULL;
+    }
+    return pArena;
+}
+
+/**
+ * Releases a private partition and all memory allocated from it at once.
+ */
+LOCAL void luaArenaDelete(LUA_ARENA * pArena)
+{
+#if defined(_WRS_VXWORKS_MAJOR) && (_WRS_VXWORKS_MAJOR >= 6)
+    memPartDelete(pArena->partId);
+#endif
+    /* Before 6.x the partition descriptor itself can not be freed */
+    free(pArena->pool);
+    free(pArena);
+}
+
+/**
+ * Called by lua on errors outside of any protected call.
+ */
+LOCAL int luaArenaPanic(lua_State * luaVM)
+{
+    printf("PANIC: unprotected error in call to Lua API (%s)\n", 
+           lua_tostring(luaVM, -1));
+    return 0;
+}
+
+#endif /* LUA_5_2 || LUA_5_1 */
+
+/****************************************************************************** 
+ * Lua states. 
+ *****************************************************************************/
+
+LOCAL SEM_ID      luaCtxSem = NULL;      /* guards luaCtxCount */
+LOCAL int         luaCtxCount = 0;       /* number of existing contexts */
+
+LOCAL SEM_ID      luaPoolSem = NULL;     /* counts the free pool contexts */
+LOCAL SEM_ID      luaPoolMutex = NULL;   /* guards luaPoolFree */
+LOCAL TSYS_LUA_ID luaPoolFree = NULL;    /* free pool contexts */
+
+/**
+ * Creates the semaphores shared by all contexts, once.
+ */
+LOCAL STATUS luaCtxLibInit()
+{
+    taskLock();
+    if (luaCtxSem == NULL)
+    {
+        luaCtxSem = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE | SEM_DELETE_SAFE);
+        cbSem     = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE | SEM_DELETE_SAFE);
+        symNameSem = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE | SEM_DELETE_SAFE);
+        symSharedSem = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE | SEM_DELETE_SAFE);
+        sysTimestampEnable();
+#ifdef INCLUDE_LUA_STATS
+        luaStatsPeriod = sysTimestampPeriod();
+#endif
+#ifdef INCLUDE_SYM_PART_MATCH
+        symIndexInit();
+#endif
+    }
+    taskUnlock();
+    return (luaCtxSem == NULL) ? ERROR : OK;
+}
+
+/* Lua libraries by TSYS_LUA_LIB_xxx */
+LOCAL const struct {
+    int           lib;
+    const char *  name;
+    lua_CFunction open;
+} luaLibs[] = {
+#if defined(LUA_5_2) || defined(LUA_5_1)
+#if defined(LUA_5_2)
+    { TSYS_LUA_LIB_BASE,        "_G",               luaopen_base        },
+#else
+    { TSYS_LUA_LIB_BASE,        "",                 luaopen_base        },
+#endif
+    { TSYS_LUA_LIB_PACKAGE,     LUA_LOADLIBNAME,    luaopen_package     },
+#if defined(LUA_5_2)
+    { TSYS_LUA_LIB_COROUTINE,   LUA_COLIBNAME,      luaopen_coroutine   },
+#endif
+    { TSYS_LUA_LIB_TABLE,       LUA_TABLIBNAME,     luaopen_table       },
+    { TSYS_LUA_LIB_IO,          LUA_IOLIBNAME,      luaopen_io          },
+    { TSYS_LUA_LIB_OS,          LUA_OSLIBNAME,      luaopen_os          },
+    { TSYS_LUA_LIB_STRING,      LUA_STRLIBNAME,     luaopen_string      },
+#if defined(LUA_5_2)
+    { TSYS_LUA_LIB_BIT32,       LUA_BITLIBNAME,     luaopen_bit32       },
+#endif
+    { TSYS_LUA_LIB_MATH,        LUA_MATHLIBNAME,    luaopen_math        },
+    { TSYS_LUA_LIB_DEBUG,       LUA_DBLIBNAME,      luaopen_debug       },
+#else
+    /* The libraries opened before version 1.5 */
+    { TSYS_LUA_LIB_BASE,        "base",             luaopen_base        },
+    { TSYS_LUA_LIB_TABLE,       "table",            luaopen_table       },
+    { TSYS_LUA_LIB_IO,          "io",               luaopen_io          },
+    { TSYS_LUA_LIB_STRING,      "string",           luaopen_string      },
+    { TSYS_LUA_LIB_MATH,        "math",             luaopen_math        },
+#endif
+    { 0,                        NULL,               NULL                }
+};
+
+/**
+ * Opens the libraries libs of a lua state and installs the libraries 
+ * lazyLibs in package.preload, so they are opened by require("name"). 
+ * Lua 5.0 has no preload, there lazy libraries are opened as well.
+ */
+LOCAL void luaOpenLibs(lua_State* luaVM, int libs, int lazyLibs)
+{
+    int i;
+
+#if defined(LUA_5_2) || defined(LUA_5_1)
+    lazyLibs &= ~(libs | TSYS_LUA_LIB_BASE | TSYS_LUA_LIB_PACKAGE);
+    if (lazyLibs != 0)
+    {
+        libs |= TSYS_LUA_LIB_PACKAGE;
+    }
+#else
+    libs |= lazyLibs;
+    lazyLibs = 0;
+#endif
+
+    for (i = 0; luaLibs[i].name != NULL; i++)
+    {
+        if (libs & luaLibs[i].lib)
+        {
+#if defined(LUA_5_2)
+            luaL_requiref(luaVM, luaLibs[i].name, luaLibs[i].open, 1);
+            lua_pop(luaVM, 1);
+#elif defined(LUA_5_1)
+            lua_pushcfunction(luaVM, luaLibs[i].open);
+            lua_pushstring(luaVM, luaLibs[i].name);
+            lua_call(luaVM, 1, 0);
+#else
+            luaLibs[i].open(luaVM);
+#endif
+        }
+    }
+
+    if (lazyLibs != 0)
+    {
+        lua_getglobal(luaVM, LUA_LOADLIBNAME);
+        lua_getfield(luaVM, -1, "preload");
+        for (i = 0; luaLibs[i].name != NULL; i++)
+        {
+            if (lazyLibs & luaLibs[i].lib)
+            {
+                lua_pushcfunction(luaVM, luaLibs[i].open);
+                lua_setfield(luaVM, -2, luaLibs[i].name);
+            }
+        }
+        lua_pop(luaVM, 2);
+    }
+}
+
+/**
+ * Registers all commands in the table vx and, unless noGlobals, as globals.
+ */
+LOCAL void luaRegisterCommands(lua_State* luaVM, BOOL noGlobals)
+{
+#if defined(LUA_5_2) || defined(LUA_5_1)
+    lua_createtable(luaVM, 0, LUA_COMMAND_COUNT);
+#else
+    lua_newtable(luaVM);
+#endif
+    luaSetFuncs(luaVM, lua_commands);
+    lua_pushstring(luaVM, "vx");
+    lua_insert(luaVM, -2);
+    luaPushGlobals(luaVM);
+    if (!noGlobals)
+    {
+        luaSetFuncs(luaVM, lua_commands);
+    }
+    lua_insert(luaVM, -3);
+    lua_rawset(luaVM, -3);      /* _G.vx = commands */
+    lua_pop(luaVM, 1);
+}
+
+/**
+ * Initialises the parameters of TSysLuaCreateEx with the defaults.
+ */
+void TSysLuaParamsInit(TSYS_LUA_PARAMS * pParams)
+{
+    memset(pParams, 0, sizeof(TSYS_LUA_PARAMS));
+    pParams->libs = TSYS_LUA_LIB_ALL;
+}
+
+/**
+ * Creates a new lua state, opens the lua libraries and registers all 
+ * commands. Returns NULL on failure.
+ */
+TSYS_LUA_ID TSysLuaCreate()
+{
+    return TSysLuaCreateEx(NULL);
+}
+
+/**
+ * Creates a new lua state like TSysLuaCreate, with parameters.
+ * pParams->arenaSize  - size of a private memory partition for all memory
+ *                       of the state, 0 to use the system memory partition.
+ *                       Requires Lua 5.1 or newer.
+ * pParams->libs       - TSYS_LUA_LIB_xxx libraries to open.
+ * pParams->lazyLibs   - TSYS_LUA_LIB_xxx libraries opened on the first
+ *                       require("name"). Requires Lua 5.1 or newer.
+ * pParams->noGlobals  - register the commands only in the table vx.
+ * pParams NULL uses the defaults of TSysLuaParamsInit.
+ */
+TSYS_LUA_ID TSysLuaCreateEx(const TSYS_LUA_PARAMS * pParams)
+{
+    TSYS_LUA_ID ctx;
+    lua_State * luaVM;
+    TSYS_LUA_PARAMS params;
+
+    if (pParams == NULL)
+    {
+        TSysLuaParamsInit(&params);
+        pParams = &params;
+    }
+
+    if (OK != luaCtxLibInit())
+    {
+        return NULL;
+    }
+
+    ctx = (TSYS_LUA_ID) calloc(1, sizeof(struct tsysLuaCtx));
+    if (NULL == ctx)
+    {
+    	printf("Error Initializing lua\n");
+        return NULL;
+    }
+    ctx->runInstr = -1;
+    ctx->runSem = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE | SEM_DELETE_SAFE);
+    if (NULL == ctx->runSem)
+    {
+    	printf("Error Initializing lua\n");
+        free(ctx);
+        return NULL;
+    }
+
+#if defined(LUA_5_2) || defined(LUA_5_1)
+    if (pParams->arenaSize != 0)
+    {
+        ctx->pArena = luaArenaCreate(pParams->arenaSize);
+        if (ctx->pArena == NULL)
+        {
+    	    printf("Error Initializing lua: no memory for arena\n");
+            semDelete(ctx->runSem);
+            free(ctx);
+            return NULL;
+        }
+    }
+#endif
+
+#if defined(LUA_5_2) || defined(LUA_5_1)
+    if (ctx->pArena != NULL)
+    {
+        luaVM = lua_newstate(luaArenaAlloc, ctx->pArena);  /* Open Lua */
+        if (luaVM) lua_atpanic(luaVM, luaArenaPanic);
+    }
+    else
+    {
+#if defined(LUA_5_2)
+        luaVM = luaL_newstate();  /* Open Lua */
+#else
+        luaVM = lua_open();       /* Open Lua */
+#endif
+    }
+#else
+    luaVM = lua_open();       /* Open Lua */
+#endif
+    if (luaVM) luaOpenLibs(luaVM, pParams->libs, pParams->lazyLibs);
+    if (NULL == luaVM)
+    {
+    	printf("Error Initializing lua\n");
+#if defined(LUA_5_2) || defined(LUA_5_1)
+        if (ctx->pArena != NULL) luaArenaDelete(ctx->pArena);
+#endif
+        semDelete(ctx->runSem);
+        free(ctx);
+        return NULL;
+    }
+    ctx->luaVM = luaVM;
+
+    lua_pushlightuserdata(luaVM, &luaCtxKey);
+    lua_pushlightuserdata(luaVM, ctx);
+    lua_rawset(luaVM, LUA_REGISTRYINDEX);
+
+    symCacheCreate(luaVM);
+    varBindingCreate(luaVM);
+    regBlockCreate(luaVM);
+    luaBufferCreate(luaVM);
+    luaScratchCreate(luaVM);
+    chunkCacheCreate(luaVM);
+    
+    luaRegisterCommands(luaVM, pParams->noGlobals);
+    lua_pushcfunction(luaVM, l_luaSnapshot);
+    lua_call(luaVM, 0, 0);
+
+    /* The first context installs the symbol cache invalidation hook */
+    semTake(luaCtxSem, WAIT_FOREVER);
+    if (luaCtxCount++ == 0)
+    {
+        moduleCreateHookAdd((FUNCPTR) symCacheModuleHook);
+    }
+    semGive(luaCtxSem);
+
+    return ctx;
+}
+
+/**
+ * Closes a lua state created by TSysLuaCreate and frees its memory.
+ */
+void TSysLuaDestroy(TSYS_LUA_ID ctx)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+
+    cbReleaseCtx(ctx);
+    luaSchedDelete(ctx);
+    lua_close(ctx->luaVM); /* Close Lua */	    
+#if defined(LUA_5_2) || defined(LUA_5_1)
+    if (ctx->pArena != NULL) luaArenaDelete(ctx->pArena);
+#endif
+    semDelete(ctx->runSem);
+    free(ctx);
+
+    /* The last context removes the hook and the shared symbols */
+    semTake(luaCtxSem, WAIT_FOREVER);
+    if (--luaCtxCount == 0)
+    {
+        moduleCreateHookDelete((FUNCPTR) symCacheModuleHook);
+        symSharedFree();
+    }
+    semGive(luaCtxSem);
+}
+
+/**
+ * Returns the lua state of a context, e.g. to register own C functions.
+ */
+lua_State * TSysLuaGetState(TSYS_LUA_ID ctx)
+{
+    return (ctx != NULL) ? ctx->luaVM : NULL;
+}
+
+/**
+ * Returns the error message of the last script or chunk run in a context 
+ * that failed, or an empty string if it succeeded.
+ */
+const char * TSysLuaGetError(TSYS_LUA_ID ctx)
+{
+    return (ctx != NULL) ? ctx->errBuf : "Lua not initialized";
+}
+
+/* Instructions between two checks of the watchdog */
+#define LUA_WATCHDOG_COUNT  1000
+
+/* Limit exceeded by a run */
+#define LUA_LIMIT_INSTR     1
+#define LUA_LIMIT_TICKS     2
+
+/**
+ * Count hook of the watchdog, aborts the run with a lua error when it 
+ * exceeds a limit of TSysLuaSetLimits. From then on it fails on every 
+ * instruction of the run, so a pcall in the script can not go on with it.
+ */
+LOCAL void luaWatchdogHook(lua_State* luaVM, lua_Debug * pDebug)
+{
+    TSYS_LUA_ID ctx = luaCtxGet(luaVM);
+    int         count = LUA_WATCHDOG_COUNT;
+
+    /* Coroutines inherit the hook and may outlive the run */
+    if (ctx == NULL || ctx->runInstr < 0)
+    {
+        return;
+    }
+    if (ctx->runExceeded == 0)
+    {
+        if (ctx->limitInstr != 0 && ctx->limitInstr < count)
+        {
+            count = ctx->limitInstr;
+        }
+        ctx->runInstr += count;
+        if (ctx->limitInstr != 0 && ctx->runInstr >= ctx->limitInstr)
+        {
+            luaLog("script exceeded %d instructions", ctx->limitInstr);
+            ctx->runExceeded = LUA_LIMIT_INSTR;
+        }
+        else if (ctx->limitTicks != 0 && (long) (tickGet() - ctx->runDeadline) >= 0)
+        {
+            luaLog("script exceeded %d ticks", ctx->limitTicks);
+            ctx->runExceeded = LUA_LIMIT_TICKS;
+        }
+        else
+        {
+            return;
+        }
+    }
+
+    lua_sethook(luaVM, luaWatchdogHook, LUA_MASKCOUNT, 1);
+    if (ctx->runExceeded == LUA_LIMIT_INSTR)
+    {
+        luaL_error(luaVM, "script exceeded its limit of %d instructions", ctx->limitInstr);
+    }
+    luaL_error(luaVM, "script exceeded its limit of %d ticks", ctx->limitTicks);
+}
+
+/**
+ * Starts the watchdog for a run of the lua thread luaVM if the context has
+ * limits.
+ */
+LOCAL void luaWatchdogStart(TSYS_LUA_ID ctx, lua_State* luaVM)
+{
+    int count = LUA_WATCHDOG_COUNT;
+
+    if (ctx->limitInstr == 0 && ctx->limitTicks == 0)
+    {
+        return;
+    }
+    if (ctx->limitInstr != 0 && ctx->limitInstr < count)
+    {
+        count = ctx->limitInstr;
+    }
+    ctx->runInstr    = 0;
+    ctx->runExceeded = 0;
+    ctx->runDeadline = tickGet() + (ULONG) ctx->limitTicks;
+    lua_sethook(luaVM, luaWatchdogHook, LUA_MASKCOUNT, count);
+}
+
+/**
+ * Stops the watchdog after a run of the lua thread luaVM.
+ */
+LOCAL void luaWatchdogStop(TSYS_LUA_ID ctx, lua_State* luaVM)
+{
+    if (ctx->limitInstr != 0 || ctx->limitTicks != 0)
+    {
+        lua_sethook(luaVM, NULL, 0, 0);
+    }
+    ctx->runInstr = -1;
+}
+
+/**
+ * Limits every run of a script or chunk in a context, and every resume of
+ * a coroutine by TSysLuaSchedRun, to maxInstr lua instructions and 
+ * maxTicks clock ticks, 0 for no limit. A run exceeding
+ * a limit is aborted with a lua error, raised again on every following 
+ * instruction of the run, so a script can not catch it with pcall and go
+ * on. The limits are checked every LUA_WATCHDOG_COUNT instructions, time 
+ * spent in C functions called by the script is not interrupted.
+ */
+STATUS TSysLuaSetLimits(TSYS_LUA_ID ctx, int maxInstr, int maxTicks)
+{
+    if (ctx == NULL || maxInstr < 0 || maxTicks < 0)
+    {
+        printf("TSysLuaSetLimits(): invalid arguments\n");
+        return ERROR;
+    }
+    ctx->limitInstr = maxInstr;
+    ctx->limitTicks = maxTicks;
+    return OK;
+}
+
+/**
+ * Runs the chunk on top of the lua stack, error is the result of loading it.
+ * outermost is TRUE unless running it from a C function called by lua.
+ */
+LOCAL STATUS luaRunChunk(TSYS_LUA_ID ctx, int error, const char * caller, BOOL outermost)
+{
+    lua_State * luaVM = ctx->luaVM;
+    const char * msg;
+
+    if ( ! error )    
+    {
+        if (outermost) luaWatchdogStart(ctx, luaVM);
+        error = lua_pcall(luaVM, 0, 0, 0);
+        if (outermost) luaWatchdogStop(ctx, luaVM);
+    }
+
+    ctx->errBuf[0] = '\0';
+    if (error)
+    {
+        msg = lua_tostring(luaVM, -1);
+        printf("%s: %s\n", caller, msg ? msg : "(error object is not a string)");
+        strncpy(ctx->errBuf, msg ? msg : "(error object is not a string)", LUA_ERR_BUF_SIZE - 1);
+        ctx->errBuf[LUA_ERR_BUF_SIZE - 1] = '\0';
+        lua_pop(luaVM, 1);
+        if (outermost) luaScratchReset(luaVM);
+        return ERROR;
+    }
+#ifdef VERBOSE       
+    printf("%s: done\n", caller);
+#endif
+    return OK;
+}
+
+/**
+ * Runs a lua script in the given context.
+ * The compiled script is cached, it is only loaded again when the file 
+ * changed. Tasks running scripts in the same context wait for each other.
+ */
+STATUS TSysRunLuaScriptEx(TSYS_LUA_ID ctx, char * luaScriptPath)
+{
+    STATUS status;
+    BOOL   entered;
+
+    if (ctx == NULL)
+    {
+        printf("TSysRunLuaScript(): Lua not initialized!\n");
+        return ERROR;
+    }
+
+#ifdef VERBOSE       
+    printf("TSysRunLuaScript(): run %s\n", luaScriptPath);
+#endif
+    entered = luaCtxEnter(ctx);
+    status  = luaRunChunk(ctx, chunkCacheLoad(ctx->luaVM, luaScriptPath),
+                          "TSysRunLuaScript()", entered);
+    luaCtxLeave(ctx, entered);
+    return status;
+}
+
+/**
+ * Runs a lua chunk from memory in the given context. The buffer holds either
+ * lua source or precompiled luac output, e.g. linked into the image or in
+ * flash, so no file system access is needed. name is used in error messages.
+ */
+STATUS TSysRunLuaBufferEx(TSYS_LUA_ID ctx, const void * buf, size_t len, const char * name)
+{
+    STATUS status;
+    BOOL   entered;
+
+    if (ctx == NULL)
+    {
+        printf("TSysRunLuaBuffer(): Lua not initialized!\n");
+        return ERROR;
+    }
+
+#ifdef VERBOSE       
+    printf("TSysRunLuaBuffer(): run %s\n", name);
+#endif
+    entered = luaCtxEnter(ctx);
+    status  = luaRunChunk(ctx, 
+                          luaL_loadbuffer(ctx->luaVM, (const char *) buf, len, name),
+                          "TSysRunLuaBuffer()", entered);
+    luaCtxLeave(ctx, entered);
+    return status;
+}
+
+/* Registry key of the snapshot of the globals, see TSysLuaSnapshot */
+LOCAL char luaSnapKey;
+
+/**
+ * Stores a copy of the contents of the table at stack index idx in the 
+ * snapshot table at stack index snapIdx, with the table as key.
+ */
+LOCAL void luaSnapTable(lua_State* luaVM, int snapIdx, int idx)
+{
+    lua_pushvalue(luaVM, idx);
+    lua_newtable(luaVM);
+    lua_pushnil(luaVM);
+    while (lua_next(luaVM, idx))
+    {
+        lua_pushvalue(luaVM, -2);
+        lua_insert(luaVM, -2);
+        lua_rawset(luaVM, -4);
+    }
+    lua_rawset(luaVM, snapIdx);
+}
+
+/**
+ * Takes the snapshot of the globals: the global table, all tables in it
+ * (the libraries), package.loaded and the metatable of the global table.
+ */
+LOCAL int l_luaSnapshot(lua_State* luaVM)
+{
+    lua_settop(luaVM, 0);
+    lua_newtable(luaVM);        /* 1: snapshot */
+    luaPushGlobals(luaVM);      /* 2: globals */
+    luaSnapTable(luaVM, 1, 2);
+
+    lua_pushnil(luaVM);
+    while (lua_next(luaVM, 2))
+    {
+        if (lua_istable(luaVM, -1) && !lua_rawequal(luaVM, -1, 2))
+        {
+            luaSnapTable(luaVM, 1, lua_gettop(luaVM));
+        }
+        lua_pop(luaVM, 1);
+    }
+
+    lua_pushstring(luaVM, "package");
+    lua_rawget(luaVM, 2);
+    if (lua_istable(luaVM, -1))
+    {
+        lua_pushstring(luaVM, "loaded");
+        lua_rawget(luaVM, -2);
+        if (lua_istable(luaVM, -1))
+        {
+            luaSnapTable(luaVM, 1, lua_gettop(luaVM));
+        }
+    }
+    lua_settop(luaVM, 2);
+
+    if (!lua_getmetatable(luaVM, 2))
+    {
+        lua_pushboolean(luaVM, 0);
+    }
+    lua_rawseti(luaVM, 1, 1);   /* snapshot[1] = metatable or false */
+
+    lua_pushlightuserdata(luaVM, &luaSnapKey);
+    lua_pushvalue(luaVM, 1);
+    lua_rawset(luaVM, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+/**
+ * Restores all tables of the snapshot to their contents at the time of the
+ * snapshot, values added since are removed.
+ */
+LOCAL int l_luaRestore(lua_State* luaVM)
+{
+    lua_settop(luaVM, 0);
+    lua_pushlightuserdata(luaVM, &luaSnapKey);
+    lua_rawget(luaVM, LUA_REGISTRYINDEX);   /* 1: snapshot */
+    if (!lua_istable(luaVM, 1))
+    {
+        return 0;
+    }
+
+    lua_pushnil(luaVM);
+    while (lua_next(luaVM, 1))
+    {
+        /* 2: key, a restored table, 3: its copy */
+        if (lua_istable(luaVM, 2))
+        {
+            lua_pushnil(luaVM);
+            while (lua_next(luaVM, 2))
+            {
+                lua_pop(luaVM, 1);
+                lua_pushvalue(luaVM, -1);
+                lua_rawget(luaVM, 3);
+                if (lua_isnil(luaVM, -1))
+                {
+                    /* Clearing fields while traversing is allowed */
+                    lua_pushvalue(luaVM, -2);
+                    lua_pushnil(luaVM);
+                    lua_rawset(luaVM, 2);
+                }
+                lua_pop(luaVM, 1);
+            }
+            lua_pushnil(luaVM);
+            while (lua_next(luaVM, 3))
+            {
+                lua_pushvalue(luaVM, -2);
+                lua_insert(luaVM, -2);
+                lua_rawset(luaVM, 2);
+            }
+        }
+        lua_pop(luaVM, 1);
+    }
+
+    luaPushGlobals(luaVM);
+    lua_rawgeti(luaVM, 1, 1);
+    if (!lua_istable(luaVM, -1))
+    {
+        lua_pop(luaVM, 1);
+        lua_pushnil(luaVM);
+    }
+    lua_setmetatable(luaVM, -2);
+    lua_settop(luaVM, 0);
+    return 0;
+}
+
+/**
+ * Takes a snapshot of the globals of a context, which TSysLuaReset 
+ * restores. TSysLuaCreate takes one, call it again after running setup
+ * scripts that shall survive resets.
+ */
+STATUS TSysLuaSnapshot(TSYS_LUA_ID ctx)
+{
+    STATUS status;
+    BOOL   entered;
+
+    if (ctx == NULL)
+    {
+        printf("TSysLuaSnapshot(): Lua not initialized!\n");
+        return ERROR;
+    }
+
+    entered = luaCtxEnter(ctx);
+    lua_pushcfunction(ctx->luaVM, l_luaSnapshot);
+    status = luaRunChunk(ctx, 0, "TSysLuaSnapshot()", entered);
+    luaCtxLeave(ctx, entered);
+    return status;
+}
+
+/**
+ * Stops the collector of a context in TSYS_LUA_GC_MANUAL mode again after
+ * an explicit collection or step, which restarts it on Lua 5.1.
+ */
+LOCAL void luaGcKeepStopped(TSYS_LUA_ID ctx)
+{
+#if defined(LUA_5_1)
+    if (ctx->gcMode == TSYS_LUA_GC_MANUAL)
+    {
+        lua_gc(ctx->luaVM, LUA_GCSTOP, 0);
+    }
+#endif
+}
+
+/**
+ * Resets a context for the next run without creating a new lua state: 
+ * restores the globals and the libraries of the last snapshot, frees the 
+ * callbacks and coroutines, clears the options and collects all garbage.
+ * Resolved symbols, compiled chunks and signatures stay cached. Must not
+ * be called from lua code running in the context.
+ */
+STATUS TSysLuaReset(TSYS_LUA_ID ctx)
+{
+    STATUS status;
+
+    if (ctx == NULL)
+    {
+        printf("TSysLuaReset(): Lua not initialized!\n");
+        return ERROR;
+    }
+    if (!luaCtxEnter(ctx))
+    {
+        printf("TSysLuaReset(): called by lua in the context\n");
+        return ERROR;
+    }
+
+    luaScratchReset(ctx->luaVM);
+    cbReleaseCtx(ctx);
+    luaSchedDelete(ctx);
+    lua_settop(ctx->luaVM, 0);
+    lua_pushcfunction(ctx->luaVM, l_luaRestore);
+    status = luaRunChunk(ctx, 0, "TSysLuaReset()", TRUE);
+    ctx->options = 0;
+    lua_gc(ctx->luaVM, LUA_GCCOLLECT, 0);
+    luaGcKeepStopped(ctx);
+
+    luaCtxLeave(ctx, TRUE);
+    return status;
+}
+
+/**
+ * Configures the garbage collector of a context. 
+ * mode     - TSYS_LUA_GC_INCREMENTAL, TSYS_LUA_GC_GENERATIONAL (Lua 5.2) or
+ *            TSYS_LUA_GC_MANUAL, which only collects in TSysLuaGcStep.
+ * pause    - percentage of memory growth that starts a new cycle, 
+ *            0 keeps the current value (lua default 200).
+ * stepmul  - speed of the collector relative to allocation in percent, 
+ *            0 keeps the current value (lua default 200).
+ * Requires Lua 5.1 or newer.
+ */
+STATUS TSysLuaSetGcMode(TSYS_LUA_ID ctx, int mode, int pause, int stepmul)
+{
+#if defined(LUA_5_2) || defined(LUA_5_1)
+    lua_State * luaVM;
+    BOOL        entered;
+
+    if (ctx == NULL)
+    {
+        printf("TSysLuaSetGcMode(): Lua not initialized!\n");
+        return ERROR;
+    }
+#if !defined(LUA_5_2)
+    if (mode == TSYS_LUA_GC_GENERATIONAL)
+    {
+        printf("TSysLuaSetGcMode(): generational mode requires Lua 5.2\n");
+        return ERROR;
+    }
+#endif
+    if (mode != TSYS_LUA_GC_INCREMENTAL && mode != TSYS_LUA_GC_GENERATIONAL && 
+        mode != TSYS_LUA_GC_MANUAL)
+    {
+        printf("TSysLuaSetGcMode(): invalid mode %d\n", mode);
+        return ERROR;
+    }
+
+    entered = luaCtxEnter(ctx);
+    luaVM   = ctx->luaVM;
+#if defined(LUA_5_2)
+    lua_gc(luaVM, (mode == TSYS_LUA_GC_GENERATIONAL) ? LUA_GCGEN : LUA_GCINC, 0);
+#endif
+    if (pause > 0)
+    {
+        lua_gc(luaVM, LUA_GCSETPAUSE, pause);
+    }
+    if (stepmul > 0)
+    {
+        lua_gc(luaVM, LUA_GCSETSTEPMUL, stepmul);
+    }
+    lua_gc(luaVM, (mode == TSYS_LUA_GC_MANUAL) ? LUA_GCSTOP : LUA_GCRESTART, 0);
+    ctx->gcMode = mode;
+    luaCtxLeave(ctx, entered);
+    return OK;
+#else
+    printf("TSysLuaSetGcMode(): requires Lua 5.1 or newer\n");
+    return ERROR;
+#endif
+}
+
+/**
+ * Runs the garbage collector of a context in small steps for about 
+ * budgetUs microseconds, for idle or periodic tasks. Does nothing if 
+ * another task runs lua in the context. Returns 1 if a collection cycle 
+ * finished, 0 if the budget ran out first, ERROR without context.
+ * Requires Lua 5.1 or newer.
+ */
+int TSysLuaGcStep(TSYS_LUA_ID ctx, int budgetUs)
+{
+#if defined(LUA_5_2) || defined(LUA_5_1)
+    int    self = (int) taskIdSelf();
+    BOOL   entered = FALSE;
+    int    done = 0;
+    UINT32 period = sysTimestampPeriod();
+    UINT32 budget;
+    UINT32 used = 0;
+    UINT32 t0;
+    UINT32 t1;
+
+    if (ctx == NULL)
+    {
+        return ERROR;
+    }
+    if (ctx->ownerTid != self)
+    {
+        if (OK != semTake(ctx->runSem, NO_WAIT))
+        {
+            return 0;
+        }
+        ctx->ownerTid = self;
+        entered = TRUE;
+    }
+
+    budget = (UINT32) ((double) budgetUs * sysTimestampFreq() / 1e6);
+    t0 = sysTimestamp();
+    while (!done && used < budget)
+    {
+        done = lua_gc(ctx->luaVM, LUA_GCSTEP, 0);
+        t1 = sysTimestamp();
+        used += (t1 >= t0) ? t1 - t0 : t1 + (period - t0);
+        t0 = t1;
+    }
+    luaGcKeepStopped(ctx);
+
+    luaCtxLeave(ctx, entered);
+    return done;
+#else
+    return ERROR;
+#endif
+}
+
+/**
+ * Creates a pool of nStates pre-initialised lua states. Tasks check out a 
+ * state with TSysLuaPoolGet and return it with TSysLuaPoolPut. 
+ * Can be called again to add more states to the pool.
+ */
+STATUS TSysLuaPoolInit(int nStates)
+{
+    TSYS_LUA_ID ctx;
+    int i;
+
+    if (OK != luaCtxLibInit())
+    {
+        return ERROR;
+    }
+
+    semTake(luaCtxSem, WAIT_FOREVER);
+    if (luaPoolSem == NULL)
+    {
+        luaPoolMutex = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE | SEM_DELETE_SAFE);
+        luaPoolSem   = semCCreate(SEM_Q_PRIORITY, 0);
+    }
+    semGive(luaCtxSem);
+
+    if (luaPoolSem == NULL || luaPoolMutex == NULL)
+    {
+        return ERROR;
+    }
+
+    for (i = 0; i < nStates; i++)
+    {
+        ctx = TSysLuaCreate();
+        if (ctx == NULL)
+        {
+            return ERROR;
+        }
+        TSysLuaPoolPut(ctx);
+    }
+    return OK;
+}
+
+/**
+ * Checks out a state of the pool, waits up to timeout ticks for a free one.
+ * Returns NULL if no state became free in time.
+ */
+TSYS_LUA_ID TSysLuaPoolGet(int timeout)
+{
+    TSYS_LUA_ID ctx;
+
+    if (luaPoolSem == NULL || OK != semTake(luaPoolSem, timeout))
+    {
+        return NULL;
+    }
+
+    semTake(luaPoolMutex, WAIT_FOREVER);
+    ctx = luaPoolFree;
+    luaPoolFree = ctx->pNext;
+    semGive(luaPoolMutex);
+
+    ctx->pNext = NULL;
+    return ctx;
+}
+
+/**
+ * Returns a state to the pool.
+ */
+void TSysLuaPoolPut(TSYS_LUA_ID ctx)
+{
+    if (ctx == NULL || luaPoolSem == NULL)
+    {
+        return;
+    }
+
+    semTake(luaPoolMutex, WAIT_FOREVER);
+    ctx->pNext = luaPoolFree;
+    luaPoolFree = ctx;
+    semGive(luaPoolMutex);
+
+    semGive(luaPoolSem);
+}
+
+/* Defaults of the asynchronous script workers */
+#define LUA_ASYNC_WORKERS       1           /* started by the first job */
+#define LUA_ASYNC_MAX_JOBS      32          /* queued jobs per worker */
+#define LUA_WORKER_PRIORITY     150
+#define LUA_WORKER_STACK        (64 * 1024)
+
+/* Asynchronous script job, the path is allocated with the job */
+typedef struct {
+    int                 priority;       /* priority to run at, -1 as is */
+    TSYS_LUA_DONE_FUNC  doneCallback;   /* called when done, or NULL */
+    void *              doneArg;        /* its first argument */
+    char                path[1];        /* script path */
+} LUA_ASYNC_JOB;
+
+LOCAL MSG_Q_ID luaAsyncQ = NULL;        /* queue of LUA_ASYNC_JOB pointers */
+
+/**
+ * Worker task of asynchronous scripts, runs jobs in its own state ctx.
+ */
+LOCAL void luaAsyncWorker(vx_usr_arg_t arg)
+{
+    TSYS_LUA_ID     ctx = (TSYS_LUA_ID) arg;
+    LUA_ASYNC_JOB * pJob;
+    STATUS          status;
+    int             ownPriority;
+
+    taskPriorityGet(0, &ownPriority);
+    for (;;)
+    {
+        if (msgQReceive(luaAsyncQ, (char *) &pJob, sizeof(pJob), WAIT_FOREVER) 
+            != sizeof(pJob))
+        {
+            continue;
+        }
+
+        if (pJob->priority >= 0)
+        {
+            taskPrioritySet(0, pJob->priority);
+        }
+        status = TSysRunLuaScriptEx(ctx, pJob->path);
+        if (pJob->priority >= 0)
+        {
+            taskPrioritySet(0, ownPriority);
+        }
+
+        if (pJob->doneCallback != NULL)
+        {
+            (*pJob->doneCallback)(pJob->doneArg, status, 
+                                  (status == OK) ? NULL : TSysLuaGetError(ctx));
+        }
+        free(pJob);
+    }
+}
+
+/**
+ * Starts nWorkers worker tasks for TSysRunLuaScriptAsync, each with its own
+ * lua state, which is not shared with the pool of TSysLuaPoolGet. The 
+ * first call creates the job queue with room for maxJobs jobs. Can be 
+ * called again to add more workers.
+ */
+STATUS TSysLuaAsyncInit(int nWorkers, int maxJobs)
+{
+    STATUS      status = OK;
+    TSYS_LUA_ID ctx;
+    int         i;
+
+    if (OK != luaCtxLibInit())
+    {
+        return ERROR;
+    }
+
+    semTake(luaCtxSem, WAIT_FOREVER);
+    if (luaAsyncQ == NULL)
+    {
+        luaAsyncQ = msgQCreate(maxJobs, sizeof(LUA_ASYNC_JOB *), MSG_Q_FIFO);
+    }
+    if (luaAsyncQ == NULL)
+    {
+        status = ERROR;
+    }
+    for (i = 0; status == OK && i < nWorkers; i++)
+    {
+        ctx = TSysLuaCreate();
+        if (ctx == NULL)
+        {
+            status = ERROR;
+        }
+        else if (ERROR == taskSpawn("tLuaWork", LUA_WORKER_PRIORITY, VX_FP_TASK, 
+                                    LUA_WORKER_STACK, (FUNCPTR) luaAsyncWorker, 
+                                    (vx_usr_arg_t) ctx, 0, 0, 0, 0, 0, 0, 0, 0, 0))
+        {
+            TSysLuaDestroy(ctx);
+            status = ERROR;
+        }
+    }
+    semGive(luaCtxSem);
+    return status;
+}
+
+/**
+ * Starts the default workers unless workers were started before. Callers 
+ * racing for the first job start them only once.
+ */
+LOCAL STATUS luaAsyncStart()
+{
+    STATUS status = OK;
+
+    if (OK != luaCtxLibInit())
+    {
+        return ERROR;
+    }
+
+    semTake(luaCtxSem, WAIT_FOREVER);
+    if (luaAsyncQ == NULL)
+    {
+        status = TSysLuaAsyncInit(LUA_ASYNC_WORKERS, LUA_ASYNC_MAX_JOBS);
+    }
+    semGive(luaCtxSem);
+    return status;
+}
+
+/**
+ * Queues a lua script to be run by a worker task and returns right away. 
+ * The worker runs it at the given task priority, -1 keeps the priority of 
+ * the worker. When done, doneCallback(doneArg, status, errMsg) is called 
+ * by the worker, errMsg is NULL on success. Returns ERROR if the job queue 
+ * is full. Starts LUA_ASYNC_WORKERS workers if TSysLuaAsyncInit was not 
+ * called before.
+ */
+STATUS TSysRunLuaScriptAsync(char * luaScriptPath, int priority, 
+                             TSYS_LUA_DONE_FUNC doneCallback, void * doneArg)
+{
+    LUA_ASYNC_JOB * pJob;
+
+    if (intContext() || luaScriptPath == NULL)
+    {
+        return ERROR;
+    }
+    if (luaAsyncQ == NULL && OK != luaAsyncStart())
+    {
+        printf("TSysRunLuaScriptAsync(): no worker\n");
+        return ERROR;
+    }
+
+    pJob = (LUA_ASYNC_JOB *) malloc(sizeof(LUA_ASYNC_JOB) + strlen(luaScriptPath));
+    if (pJob == NULL)
+    {
+        return ERROR;
+    }
+    pJob->priority     = priority;
+    pJob->doneCallback = doneCallback;
+    pJob->doneArg      = doneArg;
+    strcpy(pJob->path, luaScriptPath);
+
+    if (OK != msgQSend(luaAsyncQ, (char *) &pJob, sizeof(pJob), NO_WAIT, MSG_PRI_NORMAL))
+    {
+        printf("TSysRunLuaScriptAsync(): job queue full\n");
+        free(pJob);
+        return ERROR;
+    }
+    return OK;
+}
+
+/****************************************************************************** 
+ * Coroutine scheduler. 
+   Many scripts that mostly wait can share one lua state and one task: 
+   TSysLuaSchedSpawn(ctx, path) adds a script as coroutine, vxSpawn(fn) adds
+   a lua function, and TSysLuaSchedRun(ctx) resumes them on the calling 
+   task until all are done or TSysLuaSchedStop(ctx) is called. These 
+   functions are the yield points of a coroutine:
+     vxSleep(ticks)                  waits ticks, 0 just lets others run
+     ok = vxWaitSem(sem [, timeout]) takes a semaphore, false on timeout
+     msg = vxWaitMsg(q, maxLen [, timeout])  receives a message, nil on 
+                                     timeout
+   Waiting coroutines are polled once per tick, the scheduler sleeps while
+   none is ready. Outside of the scheduler the functions simply block the
+   task. A coroutine must not wait inside pcall or a callback from C.
+   Requires Lua 5.1 or newer.
+ *****************************************************************************/
+
+#if defined(LUA_5_2) || defined(LUA_5_1)
+
+#if defined(LUA_5_2)
+#define LUA_RESUME(co, nArgs)   lua_resume(co, NULL, nArgs)
+#else
+#define LUA_RESUME(co, nArgs)   lua_resume(co, nArgs)
+#endif
+
+/* What a coroutine waits for */
+#define CO_READY    0       /* nothing, resume in the next pass */
+#define CO_SLEEP    1       /* until wakeTick */
+#define CO_SEM      2       /* for the semaphore, or wakeTick */
+#define CO_MSG      3       /* for a message, or wakeTick */
+
+/* Scheduled coroutine */
+typedef struct luaCo {
+    struct luaCo * pNext;       /* next coroutine of the scheduler */
+    lua_State *    co;          /* the lua thread */
+    int            ref;         /* registry reference keeping it alive */
+    int            wait;        /* what it waits for, CO_xxx */
+    BOOL           timed;       /* wakeTick applies */
+    ULONG          wakeTick;    /* tick to wake up */
+    void *         obj;         /* SEM_ID or MSG_Q_ID */
+    int            maxLen;      /* maximum message length */
+} LUA_CO;
+
+/* Scheduler of a context */
+typedef struct luaSched {
+    LUA_CO *    pHead;          /* all coroutines */
+    LUA_CO *    pCur;           /* the one running, or NULL */
+    BOOL        stop;           /* TSysLuaSchedRun shall return */
+    char *      msgBuf;         /* receive buffer of CO_MSG */
+    int         msgBufLen;      /* its size */
+} LUA_SCHED;
+
+/**
+ * Returns the scheduled coroutine running as lua state luaVM, or NULL.
+ */
+LOCAL LUA_CO * luaSchedCurrent(lua_State* luaVM)
+{
+    TSYS_LUA_ID ctx = luaCtxGet(luaVM);
+
+    if (ctx == NULL || ctx->pSched == NULL || ctx->pSched->pCur == NULL ||
+        ctx->pSched->pCur->co != luaVM)
+    {
+        return NULL;
+    }
+    return ctx->pSched->pCur;
+}
+
+/**
+ * Adds the function on top of the stack of the main lua state as coroutine
+ * and pops it. It is appended to the list, luaSchedPass may be walking it.
+ */
+LOCAL STATUS luaSchedAdd(TSYS_LUA_ID ctx)
+{
+    lua_State * luaVM = ctx->luaVM;
+    LUA_SCHED * pSched = ctx->pSched;
+    LUA_CO **   ppCo;
+    LUA_CO *    pCo;
+
+    if (pSched == NULL)
     {
-        if(lua_isstring(luaVM, 1))
+        pSched = (LUA_SCHED *) calloc(1, sizeof(LUA_SCHED));
+        if (pSched == NULL)
         {
-            symName = lua_tostring(luaVM, 1);
+            lua_pop(luaVM, 1);
+            return ERROR;
         }
+        ctx->pSched = pSched;
     }
-    
-#ifdef VERBOSE       
-    printf("Function name : %s\n", lua_tostring(luaVM, 1));
-    printf("Number of args: %d\n", nArgs);
-#endif
-    
-    /* Process the function arguments */
-    for(i=2; i<=nArgs; i++)
+
+    pCo = (LUA_CO *) calloc(1, sizeof(LUA_CO));
+    if (pCo == NULL)
     {
-#ifdef VERBOSE        
-        printf("arg %d: %s\n", i, lua_tostring(luaVM, i));
-#endif
-        if(lua_isnil(luaVM, i))
-        {
-            arg[i-2] = (int)NULL;
-#ifdef VERBOSE        
-            printf("Type is NULL\n");
-#endif
-        }
-        else if(lua_isboolean(luaVM, i))
+        lua_pop(luaVM, 1);
+        return ERROR;
+    }
+
+    pCo->co  = lua_newthread(luaVM);
+    pCo->ref = luaL_ref(luaVM, LUA_REGISTRYINDEX);
+    lua_xmove(luaVM, pCo->co, 1);
+    pCo->wait = CO_READY;
+
+    for (ppCo = &pSched->pHead; *ppCo != NULL; ppCo = &(*ppCo)->pNext)
+    {
+    }
+    *ppCo = pCo;
+    return OK;
+}
+
+/**
+ * Frees the scheduler of a context that is destroyed or reset, and 
+ * releases the coroutines that did not finish.
+ */
+LOCAL void luaSchedDelete(TSYS_LUA_ID ctx)
+{
+    LUA_CO * pCo;
+
+    if (ctx->pSched == NULL)
+    {
+        return;
+    }
+    while ((pCo = ctx->pSched->pHead) != NULL)
+    {
+        ctx->pSched->pHead = pCo->pNext;
+        luaL_unref(ctx->luaVM, LUA_REGISTRYINDEX, pCo->ref);
+        free(pCo);
+    }
+    free(ctx->pSched->msgBuf);
+    free(ctx->pSched);
+    ctx->pSched = NULL;
+}
+
+/**
+ * Pushes the results of the wait of a coroutine onto its stack when it is
+ * over. Returns the number of results or -1 if it still waits.
+ */
+LOCAL int luaSchedPoll(LUA_SCHED * pSched, LUA_CO * pCo)
+{
+    BOOL timeout = pCo->timed && (long) (tickGet() - pCo->wakeTick) >= 0;
+    int  len;
+
+    switch (pCo->wait)
+    {
+    case CO_SLEEP:
+        return timeout ? 0 : -1;
+    case CO_SEM:
+        if (OK == semTake((SEM_ID) pCo->obj, NO_WAIT))
         {
-            arg[i-2] = (bool_t) lua_toboolean(luaVM, i);
-#ifdef VERBOSE        
-            printf("Type is boolean\n");
-#endif
+            lua_pushboolean(pCo->co, 1);
+            return 1;
         }
-        else if(lua_isnumber(luaVM, i))
+        if (timeout)
         {
-            arg[i-2] = (int32_t) lua_tonumber(luaVM, i);
-#ifdef VERBOSE        
-            printf("Type is number\n");
-#endif
+            lua_pushboolean(pCo->co, 0);
+            return 1;
         }
-        else if(lua_isstring(luaVM, i))
+        return -1;
+    case CO_MSG:
+        if (msgQNumMsgs((MSG_Q_ID) pCo->obj) > 0)
         {
-            arg[i-2] = (unsigned int) lua_tostring(luaVM, i);
-#ifdef VERBOSE        
-            printf("Type is string\n");
-#endif
+            if (pSched->msgBufLen < pCo->maxLen)
+            {
+                free(pSched->msgBuf);
+                pSched->msgBufLen = 0;
+                pSched->msgBuf = (char *) malloc(pCo->maxLen);
+                if (pSched->msgBuf == NULL)
+                {
+                    return -1;
+                }
+                pSched->msgBufLen = pCo->maxLen;
+            }
+            len = msgQReceive((MSG_Q_ID) pCo->obj, pSched->msgBuf, pCo->maxLen, NO_WAIT);
+            if (len >= 0)
+            {
+                lua_pushlstring(pCo->co, pSched->msgBuf, len);
+                return 1;
+            }
         }
-        else if(lua_istable(luaVM, i))
+        if (timeout)
         {
-            /* Not supported yet */
-            arg[i-2] = 0;
-#ifdef VERBOSE        
-            printf("Type is table\n");
-#endif
+            lua_pushnil(pCo->co);
+            return 1;
         }
-        else if(lua_isfunction(luaVM, i))
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Resumes all coroutines that are ready and removes the finished ones.
+ * Returns the number of coroutines resumed. outermost is TRUE unless the
+ * pass runs from a C function called by lua.
+ */
+LOCAL int luaSchedPass(TSYS_LUA_ID ctx, BOOL outermost)
+{
+    LUA_SCHED * pSched = ctx->pSched;
+    LUA_CO **   ppCo;
+    LUA_CO *    pCo;
+    int         nResumed = 0;
+    int         nResults;
+    int         status;
+    BOOL        watched;
+
+    if (pSched == NULL)
+    {
+        return 0;
+    }
+    ppCo = &pSched->pHead;
+    while ((pCo = *ppCo) != NULL && !pSched->stop)
+    {
+        /* Drop the values of the last yield, a new one has its function */
+        if (lua_status(pCo->co) == LUA_YIELD)
         {
-            /* Not supported yet */
-            arg[i-2] = 0;
-#ifdef VERBOSE        
-            printf("Type is function\n");
-#endif
+            lua_settop(pCo->co, 0);
         }
-        else if(lua_iscfunction(luaVM, i))
+        nResults = luaSchedPoll(pSched, pCo);
+        if (nResults < 0)
         {
-            /* Not supported yet */
-            arg[i-2] = 0;
-#ifdef VERBOSE        
-            printf("Type is cfunction\n");
-#endif
+            ppCo = &pCo->pNext;
+            continue;
         }
-        else if(lua_isuserdata(luaVM, i))
+
+        /* Each resume is a run for the limits, unless the pass is part of 
+           one */
+        watched = (ctx->runInstr < 0);
+        pCo->wait = CO_READY;
+        pSched->pCur = pCo;
+        if (watched) luaWatchdogStart(ctx, pCo->co);
+        status = LUA_RESUME(pCo->co, nResults);
+        if (watched) luaWatchdogStop(ctx, pCo->co);
+        pSched->pCur = NULL;
+        nResumed++;
+
+        if (status == LUA_YIELD)
         {
-            /* Not supported yet */
-            arg[i-2] = 0;
-#ifdef VERBOSE        
-            printf("Type is userdata\n");
-#endif
+            ppCo = &pCo->pNext;
+            continue;
         }
-        else if(lua_islightuserdata(luaVM, i))
+
+        if (status != 0)
         {
-            /* Not supported yet */
-            arg[i-2] = 0;
-#ifdef VERBOSE        
-            printf("Type is lightuserdata\n");
-#endif
+            /* The error may have skipped luaCallScopeEnd, no call is 
+               active as the other coroutines can not wait inside one */
+            luaLog("TSysLuaSchedRun(): %s", lua_tostring(pCo->co, -1));
+            if (outermost)
+            {
+                luaScratchReset(ctx->luaVM);
+            }
         }
-        else 
-        {
-            arg[i-2] = 0;
-#ifdef VERBOSE        
-            printf("Type is not valid!\n");
-#endif
-        }            
+        *ppCo = pCo->pNext;
+        luaL_unref(ctx->luaVM, LUA_REGISTRYINDEX, pCo->ref);
+        free(pCo);
     }
-  
-/* 
-    On our system, all functions get a leading underscore. 
-    Some other systems (ELF) do not get this leading underscore.
-*/
-#ifdef LEADING_UNDERSCORE    
-    if(symName)
+    return nResumed;
+}
+
+/**
+ * Adds a lua script to the scheduler of a context.
+ */
+STATUS TSysLuaSchedSpawn(TSYS_LUA_ID ctx, char * luaScriptPath)
+{
+    STATUS status;
+    BOOL   entered;
+
+    if (ctx == NULL)
     {
-        strcpy( symbol_name, "_" ) ;
-        strcat( symbol_name, symName ) ;
+        printf("TSysLuaSchedSpawn(): Lua not initialized!\n");
+        return ERROR;
     }
-#else
-    if(symName)
+
+    entered = luaCtxEnter(ctx);
+    if (0 != chunkCacheLoad(ctx->luaVM, luaScriptPath))
     {
-        strcpy( symbol_name, symName) ;
+        printf("TSysLuaSchedSpawn(): %s\n", lua_tostring(ctx->luaVM, -1));
+        lua_pop(ctx->luaVM, 1);
+        status = ERROR;
     }
-#endif
-    
-    if ( OK != symFindByName( sysSymTbl,
-    	      symbol_name,
-    	      &symbol_value,
-    	      &symbol_type ) )
+    else
     {
-#ifdef INCLUDE_SYM_PART_MATCH
-        if ( OK != symFindByName_4cppMangingName( sysSymTbl,
-    	           symbol_name,
-    	           &symbol_value,
-    	           &symbol_type ) )
-        {
-           printf("Error: Function %s does not exist or not unique!\n", symbol_name);
-           return 0;
-        }
-#else
-        printf("Error: Function %s does not exist!\n", symbol_name);   
-        return 0;
-#endif
+        status = luaSchedAdd(ctx);
     }
-
-    function_address = (FUNCPTR) symbol_value;
-    function_status = (*function_address)( arg[0],
-					   arg[1],
-					   arg[2],
-					   arg[3],
-					   arg[4],
-					   arg[5],
-					   arg[6],
-					   arg[7],
-					   arg[8],
-					   arg[9],
-					   arg[10],
-					   arg[11],
-					   arg[12],
-					   arg[13],
-					   arg[14] ) ;       
-    lua_pushnumber(luaVM, function_status);
-    return 1;   /* One value pushed onto the lua stack */	
-
+    luaCtxLeave(ctx, entered);
+    return status;
 }
 
-
 /**
- * Gets the value of a global variable.
+ * Runs the coroutines of a context on the calling task until all of them 
+ * are done or TSysLuaSchedStop is called.
  */
-int l_vxGet(lua_State* luaVM)
+STATUS TSysLuaSchedRun(TSYS_LUA_ID ctx)
 {
-    char*    symbol_value;
-    SYM_TYPE symbol_type;
-    int nArgs;
-    char symbol_name[128]="\"no global variable.\"";
-    const char * symName=NULL;
-    int  error = 1;
-    
-    nArgs = lua_gettop(luaVM);    
-    
-    /* First argument is always the function name */
-    if(nArgs>=1)
+    LUA_SCHED * pSched;
+    BOOL        entered;
+    BOOL        more;
+    int         nResumed;
+
+    if (ctx == NULL)
+    {
+        return ERROR;
+    }
+
+    entered = luaCtxEnter(ctx);
+    pSched  = ctx->pSched;
+    if (pSched != NULL)
+    {
+        pSched->stop = FALSE;
+    }
+    luaCtxLeave(ctx, entered);
+    if (pSched == NULL)
     {
-        if(lua_isstring(luaVM, 1))
+        return ERROR;
+    }
+
+    do
+    {
+        /* TSysLuaReset on another task may delete the scheduler between 
+           two passes, it is only looked at in the context */
+        entered  = luaCtxEnter(ctx);
+        pSched   = ctx->pSched;
+        more     = (pSched != NULL && pSched->pHead != NULL && !pSched->stop);
+        nResumed = more ? luaSchedPass(ctx, entered) : 0;
+        luaCtxLeave(ctx, entered);
+
+        /* Sleep until the next tick when all wait */
+        if (more && nResumed == 0)
         {
-            symName = lua_tostring(luaVM, 1);
-            error = 0;
+            taskDelay(1);
         }
+    } while (more);
+    return OK;
+}
+
+/**
+ * Makes TSysLuaSchedRun return after the current coroutine yields.
+ */
+void TSysLuaSchedStop(TSYS_LUA_ID ctx)
+{
+    if (ctx != NULL && ctx->pSched != NULL)
+    {
+        ctx->pSched->stop = TRUE;
     }
-    
-#ifdef VERBOSE       
-    printf("Function name : %s\n", lua_tostring(luaVM, 1));
-    printf("Number of args: %d\n", nArgs);
-#endif
-   
-   if(!error)
-   { 
-        if(symName)
-        {
-            strcpy( symbol_name, symName) ;
-        }
-        if ( OK == symFindByName( sysSymTbl,
-        	      symbol_name,
-        	      &symbol_value,
-        	      &symbol_type ) )
-        {
-            lua_pushnumber(luaVM, *((unsigned int*)symbol_value));
-            return 1;   /* One value pushed onto the lua stack */	
-        }
-        else    
-        {   /* Try again with underscore */
-            /* Both symbols with and without underscore are possible because 
-               type N_BSS does not need an underscore but a N_DATA does needs an
-               underscore.
-            */
-            strcpy( symbol_name, "_" ) ;
-            strcat( symbol_name, symName ) ;
-            if ( OK == symFindByName( sysSymTbl,
-            	      symbol_name,
-            	      &symbol_value,
-            	      &symbol_type ) )
-            {
-                lua_pushnumber(luaVM, *((unsigned int*)symbol_value));
-                return 1;   /* One value pushed onto the lua stack */	
-            }
-            else
-            {            
-                printf("Error: Symbol %s does not exist!\n", symbol_name);   
-                return 0;
-            }
-        }
+}
+
+/**
+ * Makes the running coroutine wait, with timeout ticks unless WAIT_FOREVER.
+ */
+LOCAL int luaSchedWait(lua_State* luaVM, LUA_CO * pCo, int wait, void * obj, int timeout)
+{
+    pCo->wait     = wait;
+    pCo->obj      = obj;
+    pCo->timed    = (timeout != WAIT_FOREVER);
+    pCo->wakeTick = tickGet() + (ULONG) timeout;
+    return lua_yield(luaVM, 0);
+}
+
+/**
+ * Waits a number of ticks.
+ * vxSleep(ticks)
+ */
+int l_vxSleep(lua_State* luaVM)
+{
+    int      ticks = (int) luaL_optnumber(luaVM, 1, 0);
+    LUA_CO * pCo   = luaSchedCurrent(luaVM);
+
+    if (ticks < 0) ticks = 0;
+    if (pCo != NULL)
+    {
+        return luaSchedWait(luaVM, pCo, ticks ? CO_SLEEP : CO_READY, NULL, ticks);
     }
+    taskDelay(ticks);
     return 0;
 }
 
+/**
+ * Takes a semaphore, returns false on timeout.
+ * ok = vxWaitSem(sem [, timeout])
+ */
+int l_vxWaitSem(lua_State* luaVM)
+{
+    SEM_ID   sem     = (SEM_ID) memCheckAddr(luaVM, 1);
+    int      timeout = (int) luaL_optnumber(luaVM, 2, WAIT_FOREVER);
+    LUA_CO * pCo     = luaSchedCurrent(luaVM);
+
+    if (pCo != NULL)
+    {
+        return luaSchedWait(luaVM, pCo, CO_SEM, sem, timeout);
+    }
+    lua_pushboolean(luaVM, OK == semTake(sem, timeout));
+    return 1;   /* One value pushed onto the lua stack */	
+}
 
 /**
- * Gets the value of a global variable.
+ * Receives a message, returns nil on timeout.
+ * msg = vxWaitMsg(q, maxLen [, timeout])
  */
-int l_vxSet(lua_State* luaVM)
+int l_vxWaitMsg(lua_State* luaVM)
 {
-    char*    symbol_value;
-    SYM_TYPE symbol_type;
-    int nArgs;
-    char symbol_name[128]="\"no global variable.\"";
-    const char * symName=NULL;
-    int  error = 1;
-    
-    nArgs = lua_gettop(luaVM);    
-    
-    /* First argument is always the function name */
-    if(nArgs>=1)
+    MSG_Q_ID q       = (MSG_Q_ID) memCheckAddr(luaVM, 1);
+    int      maxLen  = (int) luaL_checknumber(luaVM, 2);
+    int      timeout = (int) luaL_optnumber(luaVM, 3, WAIT_FOREVER);
+    LUA_CO * pCo     = luaSchedCurrent(luaVM);
+    char *   buf;
+    int      len;
+
+    luaL_argcheck(luaVM, maxLen > 0, 2, "invalid length");
+    if (pCo != NULL)
     {
-        if(lua_isstring(luaVM, 1))
-        {
-            symName = lua_tostring(luaVM, 1);
-            error = 0;
-        }
+        pCo->maxLen = maxLen;
+        return luaSchedWait(luaVM, pCo, CO_MSG, q, timeout);
     }
-    if(nArgs<2) error = 1;
-    
-#ifdef VERBOSE       
-    printf("Function name : %s\n", lua_tostring(luaVM, 1));
-    printf("Number of args: %d\n", nArgs);
-#endif
-   
-   if(!error)
-   { 
-        if(symName)
-        {
-            strcpy( symbol_name, symName) ;
-        }
-        if ( OK == symFindByName( sysSymTbl,
-        	      symbol_name,
-        	      &symbol_value,
-        	      &symbol_type ) )
-        {
-            ((unsigned int*)symbol_value)[0]=lua_tonumber(luaVM, 2);                        
-            return 0;   /* One value pushed onto the lua stack */	
-        }
-        else
-        {   /* Try again with underscore */
-            /* Both symbols with and without underscore are possible because 
-               type N_BSS does not need an underscore but a N_DATA does needs an
-               underscore.
-            */
-            strcpy( symbol_name, "_" ) ;
-            strcat( symbol_name, symName ) ;
-            if ( OK == symFindByName( sysSymTbl,
-            	      symbol_name,
-            	      &symbol_value,
-            	      &symbol_type ) )
-            {
-                ((unsigned int*)symbol_value)[0]=lua_tonumber(luaVM, 2);                        
-                return 0;   /* One value pushed onto the lua stack */	
-            }
-            else
-            {
-                printf("Error: Symbol %s does not exist!\n", symbol_name);   
-                return 0;
-            }
-        }
+
+    buf = (char *) lua_newuserdata(luaVM, maxLen);
+    len = msgQReceive(q, buf, maxLen, timeout);
+    if (len < 0)
+    {
+        lua_pushnil(luaVM);
     }
-    return 0;
+    else
+    {
+        lua_pushlstring(luaVM, buf, len);
+    }
+    return 1;   /* One value pushed onto the lua stack */	
 }
 
-
 /**
- * You can add c functions to Lua like this.
+ * Adds a lua function as coroutine to the scheduler of the lua state.
+ * vxSpawn(fn)
  */
-int l_myLuaFunction(lua_State* luaVM)
+int l_vxSpawn(lua_State* luaVM)
 {
-    return 0;   
+    TSYS_LUA_ID ctx = luaCtxGet(luaVM);
+
+    luaL_checktype(luaVM, 1, LUA_TFUNCTION);
+    lua_pushvalue(luaVM, 1);
+    lua_xmove(luaVM, ctx->luaVM, 1);
+    if (OK != luaSchedAdd(ctx))
+    {
+        return luaL_error(luaVM, "vxSpawn: out of memory");
+    }
+    return 0;
+}
+
+#else  /* Lua 5.0 */
+
+LOCAL void luaSchedDelete(TSYS_LUA_ID ctx)
+{
+}
+
+STATUS TSysLuaSchedSpawn(TSYS_LUA_ID ctx, char * luaScriptPath)
+{
+    printf("TSysLuaSchedSpawn(): requires Lua 5.1 or newer\n");
+    return ERROR;
+}
+
+STATUS TSysLuaSchedRun(TSYS_LUA_ID ctx)
+{
+    return ERROR;
+}
+
+void TSysLuaSchedStop(TSYS_LUA_ID ctx)
+{
+}
+
+int l_vxSleep(lua_State* luaVM)
+{
+    taskDelay((int) luaL_optnumber(luaVM, 1, 0));
+    return 0;
+}
+
+int l_vxWaitSem(lua_State* luaVM)
+{
+    lua_pushboolean(luaVM, OK == semTake((SEM_ID) memCheckAddr(luaVM, 1), 
+                                         (int) luaL_optnumber(luaVM, 2, WAIT_FOREVER)));
+    return 1;   /* One value pushed onto the lua stack */	
+}
+
+int l_vxWaitMsg(lua_State* luaVM)
+{
+    int    maxLen = (int) luaL_checknumber(luaVM, 2);
+    char * buf    = (char *) lua_newuserdata(luaVM, maxLen);
+    int    len    = msgQReceive((MSG_Q_ID) memCheckAddr(luaVM, 1), buf, maxLen,
+                                (int) luaL_optnumber(luaVM, 3, WAIT_FOREVER));
+
+    if (len < 0)
+        lua_pushnil(luaVM);
+    else
+        lua_pushlstring(luaVM, buf, len);
+    return 1;   /* One value pushed onto the lua stack */	
 }
 
+int l_vxSpawn(lua_State* luaVM)
+{
+    return luaL_error(luaVM, "vxSpawn requires Lua 5.1 or newer");
+}
+
+#endif /* Lua 5.0 */
+
 /**
  * Starts Lua and opens lua libraries.
  */
 void TSysStartLua()
 {
-    int i;
-
-#if defined(LUA_5_2)
-    luaVM = luaL_newstate();  /* Open Lua */
-    luaL_openlibs(luaVM);
-#elif defined(LUA_5_1)
-    luaVM = lua_open();       /* Open Lua */
-    luaL_openlibs(luaVM);
-#else
-    luaopen_base(luaVM);     
-    luaopen_table(luaVM);    
-    luaopen_io(luaVM);       
-    luaopen_string(luaVM);   
-    luaopen_math(luaVM);     
-#endif
-    if (NULL == luaVM)
+    if (luaCtx == NULL)
     {
-    	printf("Error Initializing lua\n");
-        return;
+        luaCtx = TSysLuaCreate();
     }
-    
-    /* Register all commands */
-    for (i = 0; lua_commands[i].name; i++)
-    {
-        lua_register(luaVM,lua_commands[i].name,lua_commands[i].wrapper);
-    }    
 }
 
 /**
@@ -643,7 +6411,8 @@ void TSysStartLua()
  */
 void TSysStopLua()
 {
-    if(luaVM!=NULL) lua_close(luaVM); /* Close Lua */	    
+    TSysLuaDestroy(luaCtx);
+    luaCtx = NULL;
 }
 
 /**
@@ -651,21 +6420,15 @@ void TSysStopLua()
  */
 void TSysRunLuaScript(char * luaScriptPath)
 {
-    if(luaVM!=NULL) 
-    {
-#if defined(LUA_5_2)
-       printf("TSysRunLuaScript(): run %s\n", luaScriptPath);
-       if ( ! ( luaL_dofile(luaVM, luaScriptPath) ) )    
-          printf("TSysRunLuaScript(): done");
+    TSysRunLuaScriptEx(luaCtx, luaScriptPath);
+}
 
-#elif defined(LUA_5_1)
-       luaL_dofile(luaVM, luaScriptPath);    
-#else
-       lua_dofile(luaVM, luaScriptPath);
-#endif
-    }
-    else
-        printf("TSysRunLuaScript(): Lua not initialized!\n");
+/**
+ * Runs a lua chunk (source or precompiled) from memory.
+ */
+void TSysRunLuaBuffer(const void * buf, size_t len, const char * name)
+{
+    TSysRunLuaBufferEx(luaCtx, buf, len, name);
 }
 
 /****************************************************************************** 
@@ -1,8 +1,86 @@
 #ifndef VXLUAGLUE_H
 #define VXLUAGLUE_H
 
+#include <vxWorks.h>
+#include <moduleLib.h>
+
+#include "lua.h"
+
+/* Handle of a lua context */
+typedef struct tsysLuaCtx * TSYS_LUA_ID;
+
+/* Completion callback of TSysRunLuaScriptAsync, errMsg is NULL on success */
+typedef void (*TSYS_LUA_DONE_FUNC)(void * doneArg, STATUS status, const char * errMsg);
+
+/* Lua libraries of TSYS_LUA_PARAMS, some only exist in some lua versions */
+#define TSYS_LUA_LIB_BASE       0x0001
+#define TSYS_LUA_LIB_PACKAGE    0x0002
+#define TSYS_LUA_LIB_COROUTINE  0x0004
+#define TSYS_LUA_LIB_TABLE      0x0008
+#define TSYS_LUA_LIB_IO         0x0010
+#define TSYS_LUA_LIB_OS         0x0020
+#define TSYS_LUA_LIB_STRING     0x0040
+#define TSYS_LUA_LIB_BIT32      0x0080
+#define TSYS_LUA_LIB_MATH       0x0100
+#define TSYS_LUA_LIB_DEBUG      0x0200
+#define TSYS_LUA_LIB_ALL        0xffff
+
+/* Garbage collector modes of TSysLuaSetGcMode */
+#define TSYS_LUA_GC_INCREMENTAL     0   /* lua default */
+#define TSYS_LUA_GC_GENERATIONAL    1   /* Lua 5.2 only */
+#define TSYS_LUA_GC_MANUAL          2   /* only collects in TSysLuaGcStep */
+
+/* Parameters of TSysLuaCreateEx, initialise with TSysLuaParamsInit */
+typedef struct {
+    size_t arenaSize;   /* private memory partition size, 0 uses malloc */
+    int    libs;        /* TSYS_LUA_LIB_xxx opened at creation, default all */
+    int    lazyLibs;    /* TSYS_LUA_LIB_xxx opened by require, default none */
+    BOOL   noGlobals;   /* commands only in the vx table, not as globals */
+} TSYS_LUA_PARAMS;
+
 extern void TSysStartLua();
 extern void TSysStopLua();
 extern void TSysRunLuaScript(char * luaScriptPath);
+extern void TSysRunLuaBuffer(const void * buf, size_t len, const char * name);
+
+extern TSYS_LUA_ID TSysLuaCreate();
+extern void        TSysLuaParamsInit(TSYS_LUA_PARAMS * pParams);
+extern TSYS_LUA_ID TSysLuaCreateEx(const TSYS_LUA_PARAMS * pParams);
+extern void        TSysLuaDestroy(TSYS_LUA_ID ctx);
+extern lua_State * TSysLuaGetState(TSYS_LUA_ID ctx);
+extern STATUS      TSysRunLuaScriptEx(TSYS_LUA_ID ctx, char * luaScriptPath);
+extern void        TSysLuaChunkCacheFlush(TSYS_LUA_ID ctx);
+extern STATUS      TSysRunLuaBufferEx(TSYS_LUA_ID ctx, const void * buf, 
+                                      size_t len, const char * name);
+extern const char * TSysLuaGetError(TSYS_LUA_ID ctx);
+extern STATUS      TSysLuaSnapshot(TSYS_LUA_ID ctx);
+extern STATUS      TSysLuaReset(TSYS_LUA_ID ctx);
+extern STATUS      TSysLuaSetGcMode(TSYS_LUA_ID ctx, int mode, int pause, int stepmul);
+extern int         TSysLuaGcStep(TSYS_LUA_ID ctx, int budgetUs);
+extern STATUS      TSysLuaSetLimits(TSYS_LUA_ID ctx, int maxInstr, int maxTicks);
+
+extern STATUS      TSysLuaPoolInit(int nStates);
+extern TSYS_LUA_ID TSysLuaPoolGet(int timeout);
+extern void        TSysLuaPoolPut(TSYS_LUA_ID ctx);
+
+extern STATUS      TSysLuaAsyncInit(int nWorkers, int maxJobs);
+extern STATUS      TSysRunLuaScriptAsync(char * luaScriptPath, int priority, 
+                                         TSYS_LUA_DONE_FUNC doneCallback, 
+                                         void * doneArg);
+
+extern STATUS      TSysLuaSchedSpawn(TSYS_LUA_ID ctx, char * luaScriptPath);
+extern STATUS      TSysLuaSchedRun(TSYS_LUA_ID ctx);
+extern void        TSysLuaSchedStop(TSYS_LUA_ID ctx);
+
+extern void   TSysLuaLogDump();
+extern void   TSysLuaDumpStats(TSYS_LUA_ID ctx);
+
+extern void   TSysLuaSymCacheFlush();
+extern STATUS TSysLuaUnld(char * name, int options);
+extern STATUS TSysLuaUnldByModuleId(MODULE_ID moduleId, int options);
+
+/* Benchmarks, in vxLuaBench.c */
+extern void   TSysLuaBench(int count, const char * scriptPath);
+extern void   TSysLuaArgBench(int count);
 
 #endif